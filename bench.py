@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+
+import argparse
+import datetime
+import glob
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+
+from grade import TIMEOUT
+
+# Version of the baseline file layout
+FORMAT = 1
+
+# Benchmarks as mdriver arguments. Most are traces, picked for the code
+# they stress. The last one times the replay that touches payloads.
+BENCHMARKS = [
+    ('random', ['-f', 'traces/random.rep']),          # find_fit, best fit
+    ('random2', ['-f', 'traces/random2.rep']),
+    ('coalescing', ['-f', 'traces/coalescing.rep']),  # coalesce
+    ('coalesce-big', ['-f', 'traces/coalesce-big.rep']),
+    ('binary2', ['-f', 'traces/binary2.rep']),        # splitting
+    ('realloc2', ['-f', 'traces/realloc2.rep']),      # realloc in place
+    ('amptjp', ['-f', 'traces/amptjp.rep']),
+    ('cccp', ['-f', 'traces/cccp.rep']),
+    ('login', ['-f', 'traces/login.rep']),            # recorded programs
+    ('xterm', ['-f', 'traces/xterm.rep']),
+    ('touch-random2', ['-w', '5', '-f', 'traces/random2.rep']),
+]
+
+RUNS = 15       # samples of each benchmark
+ALPHA = 0.01    # significance level of Mann-Whitney test
+MINDROP = 2.0   # smallest slowdown of medians reported, in percent
+UTILDROP = 0.05 # smallest utilization drop reported, in points
+
+TOUCH = re.compile(r'Touch replay .*, (\d+) Kops')
+
+
+def runbench(args):
+    """Return throughput in Kops and utilization of one mdriver run."""
+    mdriver = subprocess.run(['./mdriver'] + args, capture_output=True,
+                             timeout=TIMEOUT)
+    if mdriver.returncode:
+        sys.exit('mdriver %s failed:\n%s' %
+                 (' '.join(args), mdriver.stdout.decode()))
+
+    # Same line of mdriver output as parsed by grade.py
+    lines = mdriver.stdout.decode().splitlines()
+    stats = lines[3][4:].split()
+    kops = float(stats[-2])
+    for line in lines[4:]:
+        match = TOUCH.match(line)
+        if match:
+            kops = float(match.group(1))
+
+    return kops, float(stats[1][:-1])
+
+
+def measure(runs):
+    """Run every benchmark runs times, interleaved so drift hits all."""
+    results = {name: {'kops': [], 'util': None} for name, _ in BENCHMARKS}
+
+    for i in range(runs):
+        print('\rrun %d/%d' % (i + 1, runs), end='', file=sys.stderr)
+        for name, args in BENCHMARKS:
+            kops, util = runbench(args)
+            results[name]['kops'].append(kops)
+            results[name]['util'] = util
+    print(file=sys.stderr)
+
+    return results
+
+
+def median(xs):
+    xs = sorted(xs)
+    return (xs[(len(xs) - 1) // 2] + xs[len(xs) // 2]) / 2
+
+
+def mannwhitney(base, new):
+    """Return p-value of one-sided Mann-Whitney test that samples in new
+    tend to be smaller than in base. Uses normal approximation with tie
+    and continuity corrections, which is good enough from 8 samples up.
+    """
+    n1, n2 = len(base), len(new)
+    u = sum(1.0 if b > x else 0.5 if b == x else 0.0
+            for b in base for x in new)
+
+    counts = {}
+    for x in base + new:
+        counts[x] = counts.get(x, 0) + 1
+    n = n1 + n2
+    ties = sum(t ** 3 - t for t in counts.values()) / (n * (n - 1))
+    sigma = math.sqrt(n1 * n2 / 12.0 * ((n + 1) - ties))
+    if sigma == 0:
+        return 1.0
+
+    z = (u - n1 * n2 / 2.0 - 0.5) / sigma
+    return 0.5 * math.erfc(z / math.sqrt(2))
+
+
+def revision():
+    git = subprocess.run(['git', 'describe', '--always', '--dirty'],
+                         capture_output=True)
+    return git.stdout.decode().strip() or 'unknown'
+
+
+def record(args):
+    results = measure(args.runs)
+    path = args.output or os.path.join('bench', revision() + '.json')
+    os.makedirs(os.path.dirname(path) or '.', exist_ok=True)
+
+    with open(path, 'w') as f:
+        json.dump({'format': FORMAT,
+                   'revision': revision(),
+                   'date': datetime.datetime.now().isoformat(),
+                   'runs': args.runs,
+                   'results': results}, f, indent=2)
+    print('Baseline of %s saved to %s' % (revision(), path))
+
+
+def compare(args):
+    path = args.baseline
+    if path is None:
+        baselines = glob.glob(os.path.join('bench', '*.json'))
+        if not baselines:
+            sys.exit('No baseline in bench/, record one with "make baseline"')
+        path = max(baselines, key=os.path.getmtime)
+
+    with open(path) as f:
+        baseline = json.load(f)
+    if baseline.get('format') != FORMAT:
+        sys.exit('%s has format %s, expected %d' %
+                 (path, baseline.get('format'), FORMAT))
+
+    print('Comparing %s against baseline %s (%s)' %
+          (revision(), baseline['revision'], path))
+    results = measure(args.runs)
+
+    print('%-16s %9s %9s %7s %8s %7s %7s' %
+          ('benchmark', 'base Kops', 'new Kops', 'change', 'p', 'base',
+           'util'))
+    slower, worse = [], []
+    for name, _ in BENCHMARKS:
+        if name not in baseline['results']:
+            print('%-16s not in baseline' % name)
+            continue
+        base, new = baseline['results'][name], results[name]
+        old, now = median(base['kops']), median(new['kops'])
+        change = 100.0 * (now - old) / old
+        p = mannwhitney(base['kops'], new['kops'])
+
+        verdict = ''
+        if p < ALPHA and -change >= MINDROP:
+            slower.append(name)
+            verdict = ' slower'
+        if new['util'] < base['util'] - UTILDROP:
+            worse.append(name)
+            verdict += ' less util'
+
+        print('%-16s %9.0f %9.0f %+6.1f%% %8.4f %6.1f%% %6.1f%%%s' %
+              (name, old, now, change, p, base['util'], new['util'],
+               verdict))
+
+    if slower:
+        print('Throughput regressed in: %s' % ', '.join(slower))
+    if worse:
+        print('Utilization regressed in: %s' % ', '.join(worse))
+    if slower or worse:
+        sys.exit(1)
+    print('No significant regressions.')
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+        description='Benchmark mdriver and compare with stored baselines.')
+    parser.add_argument('-n', '--runs', type=int, default=RUNS,
+                        help='samples of each benchmark (default %d)' % RUNS)
+    commands = parser.add_subparsers(dest='command', required=True)
+
+    parser_record = commands.add_parser('record', help='save a baseline')
+    parser_record.add_argument('-o', '--output',
+                               help='file (default bench/<revision>.json)')
+    parser_record.set_defaults(func=record)
+
+    parser_compare = commands.add_parser(
+        'compare', help='compare with a baseline, exit 1 on regression')
+    parser_compare.add_argument('baseline', nargs='?',
+                                help='file (default newest in bench/)')
+    parser_compare.set_defaults(func=compare)
+
+    args = parser.parse_args()
+    args.func(args)
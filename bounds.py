@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+
+import re
+import subprocess
+import sys
+
+from grade import TIMEOUT, TRACEFILES
+
+# Line printed by 'mdriver -B', see printbound in mdriver.c
+BOUND = re.compile(r'Bound: (\d+) aligned live bytes \(([\d.]+)% util\), '
+                   r'offline placer (\d+) bytes \(([\d.]+)% util\), '
+                   r'gap (-?[\d.]+)%')
+
+
+def runtrace(trace):
+    try:
+        mdriver = subprocess.run(["./mdriver", "-B", "-f", trace],
+                                 capture_output=True, timeout=TIMEOUT)
+    except subprocess.TimeoutExpired:
+        return None
+
+    if mdriver.returncode:
+        return None
+
+    # Same line of mdriver output as parsed by grade.py
+    lines = mdriver.stdout.decode().splitlines()
+    stats = lines[3][4:].split()
+    bound = BOUND.match(lines[4]).groups()
+
+    return (int(stats[2]), int(bound[0]), int(bound[2]), int(stats[3]),
+            float(bound[1]), float(bound[3]), float(stats[1][:-1]),
+            float(bound[4]))
+
+
+if __name__ == '__main__':
+    traces = sys.argv[1:] or TRACEFILES
+
+    print('%-26s %9s %9s %9s %9s %7s %7s %7s %6s' %
+          ('trace', 'used', 'aligned', 'offline', 'heap', 'aligned',
+           'offline', 'mm', 'gap'))
+
+    rows = []
+    for trace in traces:
+        result = runtrace(trace)
+        if result is None:
+            print('%-26s %s' % (trace.split('/')[-1], 'failed'))
+            continue
+        rows.append((trace.split('/')[-1],) + result)
+
+    # Traces where mm.c is furthest from the offline placer come first
+    rows.sort(key=lambda row: -row[-1])
+    for row in rows:
+        print('%-26s %9d %9d %9d %9d %6.1f%% %6.1f%% %6.1f%% %6.1f' % row)
+
+    if rows:
+        print('%-26s %70.1f' %
+              ('average', sum(row[-1] for row in rows) / len(rows)))
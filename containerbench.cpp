@@ -0,0 +1,190 @@
+/*
+ * containerbench.cpp - Time standard containers with the default
+ *                      allocator against the allocators of mm.hpp.
+ *
+ * Every workload runs with std::allocator (libc malloc), mm::allocator
+ * without a size class (mm_malloc for everything), mm::allocator with a
+ * size class that fits the nodes of the container (pools), and a pmr
+ * container on mm::memory_resource. Results show which containers gain
+ * from the switch, so it can be made one container at a time.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <random>
+#include <unordered_map>
+#include <unistd.h>
+#include <vector>
+
+#include "mm.hpp"
+
+/* Size class that fits nodes of the containers below on x86-64 */
+#define NODE_CLASS 64
+
+#define RUNS 3 /* times each workload is run */
+
+template <class A> using map_t = std::map<long, long, std::less<long>, A>;
+template <class A>
+using umap_t =
+  std::unordered_map<long, long, std::hash<long>, std::equal_to<long>, A>;
+template <class A> using list_t = std::list<long, A>;
+template <class A> using vector_t = std::vector<long, A>;
+
+using pair_t = std::pair<const long, long>;
+
+static long sink; /* keeps results of workloads alive */
+
+/*
+ * Workloads - insert random keys, look them all up and erase them
+ * (maps), push and pop at both ends (list), and grow n / 100 vectors
+ * one element at a time to 1000 elements (vector).
+ */
+template <class Map> static void map_workload(Map &&m, long n) {
+  std::mt19937_64 rng(1);
+
+  for (long i = 0; i < n; i++)
+    m.emplace(rng() % (4 * n), i);
+  rng.seed(1);
+  for (long i = 0; i < n; i++)
+    sink += m.count(rng() % (4 * n));
+  rng.seed(1);
+  for (long i = 0; i < n; i++)
+    m.erase(rng() % (4 * n));
+}
+
+template <class List> static void list_workload(List &&l, long n) {
+  for (int round = 0; round < 4; round++) {
+    for (long i = 0; i < n; i++) {
+      l.push_back(i);
+      if (i % 3 == 0)
+        l.pop_front();
+    }
+    while (!l.empty())
+      l.pop_back();
+  }
+}
+
+template <class Vector, class... Args>
+static void vector_workload(long n, Args &...args) {
+  std::vector<Vector> vectors;
+
+  for (long v = 0; v < n / 100; v++) {
+    vectors.emplace_back(args...);
+    for (long i = 0; i < 1000; i++)
+      vectors.back().push_back(i);
+    if (v % 2)
+      vectors.erase(vectors.begin());
+  }
+  sink += vectors.size();
+}
+
+/*
+ * run - time one workload, best of RUNS runs
+ */
+template <class F> static double run(F f) {
+  double best = 0;
+
+  for (int i = 0; i < RUNS; i++) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> secs =
+      std::chrono::steady_clock::now() - start;
+    if (i == 0 || secs.count() < best)
+      best = secs.count();
+  }
+  return best;
+}
+
+static void report(const char *name, long n, double std_secs,
+                   double mm_secs, double pool_secs, double pmr_secs) {
+  printf("%-14s %10.0f %10.0f %10.0f %10.0f   %5.2fx %5.2fx %5.2fx\n", name,
+         n / 1e3 / std_secs, n / 1e3 / mm_secs, n / 1e3 / pool_secs,
+         n / 1e3 / pmr_secs, std_secs / mm_secs, std_secs / pool_secs,
+         std_secs / pmr_secs);
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: containerbench [-h] [-n <elements>]\n");
+  fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-h             Print this message.\n");
+  fprintf(stderr, "\t-n <elements>  Put <elements> elements in containers.\n");
+}
+
+int main(int argc, char **argv) {
+  long n = 200000;
+  int c;
+
+  while ((c = getopt(argc, argv, "hn:")) != EOF) {
+    switch (c) {
+      case 'n':
+        n = atol(optarg);
+        break;
+
+      case 'h':
+        usage();
+        exit(EXIT_SUCCESS);
+
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  mem_init();
+  if (mm_init() < 0) {
+    fprintf(stderr, "mm_init failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%-14s %10s %10s %10s %10s   %6s %6s %6s\n", "Kops", "std", "mm",
+         "mm pool", "mm pmr", "mm", "pool", "pmr");
+
+  report(
+    "map", n,
+    run([&] { map_workload(map_t<std::allocator<pair_t>>(), n); }),
+    run([&] { map_workload(map_t<mm::allocator<pair_t>>(), n); }),
+    run([&] { map_workload(map_t<mm::allocator<pair_t, NODE_CLASS>>(), n); }),
+    run([&] {
+      mm::memory_resource resource;
+      map_workload(std::pmr::map<long, long>(&resource), n);
+    }));
+
+  report(
+    "unordered_map", n,
+    run([&] { map_workload(umap_t<std::allocator<pair_t>>(), n); }),
+    run([&] { map_workload(umap_t<mm::allocator<pair_t>>(), n); }),
+    run([&] { map_workload(umap_t<mm::allocator<pair_t, NODE_CLASS>>(), n); }),
+    run([&] {
+      mm::memory_resource resource;
+      map_workload(std::pmr::unordered_map<long, long>(&resource), n);
+    }));
+
+  report(
+    "list", 4 * n,
+    run([&] { list_workload(list_t<std::allocator<long>>(), n); }),
+    run([&] { list_workload(list_t<mm::allocator<long>>(), n); }),
+    run([&] { list_workload(list_t<mm::allocator<long, NODE_CLASS>>(), n); }),
+    run([&] {
+      mm::memory_resource resource;
+      list_workload(std::pmr::list<long>(&resource), n);
+    }));
+
+  /* Vector buffers outgrow pools, so pool and plain mm are the same */
+  report(
+    "vector growth", 10 * n,
+    run([&] { vector_workload<vector_t<std::allocator<long>>>(n); }),
+    run([&] { vector_workload<vector_t<mm::allocator<long>>>(n); }),
+    run([&] { vector_workload<vector_t<mm::allocator<long, NODE_CLASS>>>(n); }),
+    run([&] {
+      mm::memory_resource resource;
+      std::pmr::polymorphic_allocator<long> alloc(&resource);
+      vector_workload<std::pmr::vector<long>>(n, alloc);
+    }));
+
+  mm_checkheap(0);
+  mem_deinit();
+
+  return EXIT_SUCCESS;
+}
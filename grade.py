@@ -6,8 +6,15 @@ import subprocess
 import sys
 
 
-STUDENT_DEFINED = ['mm_calloc', 'mm_checkheap', 'mm_free', 'mm_init',
-                   'mm_malloc', 'mm_realloc']
+STUDENT_DEFINED = ['mm_calloc', 'mm_checkheap', 'mm_checkpoint', 'mm_free',
+                   'mm_free_isolated', 'mm_generation', 'mm_get_root',
+                   'mm_heap_walk', 'mm_init', 'mm_malloc',
+                   'mm_malloc_isolated', 'mm_memalign', 'mm_open',
+                   'mm_pool_alloc', 'mm_pool_create', 'mm_pool_destroy',
+                   'mm_pool_free', 'mm_pool_stats', 'mm_realloc',
+                   'mm_region_alloc', 'mm_region_create', 'mm_region_destroy',
+                   'mm_set_root', 'mm_stats', 'mm_trace_read', 'mm_trim',
+                   'mm_usable_size', 'mm_verify']
 
 
 MINUTIL = 60
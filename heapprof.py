@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+
+import argparse
+import math
+import os
+import re
+import subprocess
+import sys
+
+# Lines of a heap profile written by libmm.so, see profile_write in libmm.c
+# Profiles written before heap_v2 was used give the mean rate with heap/
+HEADER = re.compile(
+    r'heap profile: *\d+: *\d+ \[ *\d+: *\d+\] @ heap(?:_v2)?/(\d+)')
+STACK = re.compile(r'(\d+): *(\d+) \[ *(\d+): *(\d+)\] @((?: 0x[0-9a-f]+)*)')
+MAPPING = re.compile(r'([0-9a-f]+)-([0-9a-f]+) \S+ ([0-9a-f]+) \S+ \d+ +(/.*)')
+
+# Frames of the allocator itself are left out of stacks
+ALLOCATOR = 'libmm.so'
+
+
+def readprofile(path):
+    """Return sampling rate, stacks and mappings of a profile."""
+    with open(path) as f:
+        lines = f.read().splitlines()
+
+    header = HEADER.match(lines[0])
+    if not header:
+        sys.exit('%s is not a heap profile' % path)
+
+    stacks, mappings = [], []
+    for line in lines[1:]:
+        stack = STACK.match(line)
+        mapping = MAPPING.match(line)
+        if stack:
+            counts = tuple(int(x) for x in stack.groups()[:4])
+            pcs = [int(pc, 16) for pc in stack.group(5).split()]
+            stacks.append((counts, pcs))
+        elif mapping:
+            start, end, offset = (int(x, 16) for x in mapping.groups()[:3])
+            mappings.append((start, end, offset, mapping.group(4)))
+
+    return int(header.group(1)), stacks, mappings
+
+
+def is_executable(path):
+    """Check if ELF file is a position dependent executable."""
+    with open(path, 'rb') as f:
+        return f.read(18)[16:18] == b'\x02\x00'
+
+
+def symbolize(pcs, mappings):
+    """Return function names of addresses, found with addr2line."""
+    names = {pc: '0x%x' % pc for pc in pcs}
+    byfile = {}
+
+    for pc in pcs:
+        for start, end, offset, path in mappings:
+            if start <= pc < end:
+                byfile.setdefault(path, []).append((pc, pc - start + offset))
+                break
+
+    for path, addrs in byfile.items():
+        if os.path.basename(path).startswith(ALLOCATOR):
+            for pc, _ in addrs:
+                names[pc] = None
+            continue
+        if not os.path.exists(path):
+            continue
+
+        # Return addresses point after the call, look up the call itself
+        fixed = is_executable(path)
+        query = ['0x%x' % ((pc if fixed else rel) - 1) for pc, rel in addrs]
+        addr2line = subprocess.run(['addr2line', '-f', '-C', '-e', path] +
+                                   query, capture_output=True)
+        out = addr2line.stdout.decode().splitlines()[::2]
+        for (pc, _), name in zip(addrs, out):
+            if name != '??':
+                names[pc] = name
+            else:
+                names[pc] = '%s+0x%x' % (os.path.basename(path), _)
+
+    return names
+
+
+def unsample(count, size, rate):
+    """Estimate bytes allocated from bytes of sampled blocks. A block of
+    avg bytes is sampled with probability 1 - exp(-avg / rate)."""
+    if count == 0:
+        return 0
+    avg = size / count
+    return size / (1 - math.exp(-avg / rate))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+        description='Turn a heap profile of libmm.so into folded stacks, '
+                    'one "caller;...;callee bytes" line per stack.')
+    parser.add_argument('-t', '--total', action='store_true',
+                        help='all allocated bytes, not only live ones')
+    parser.add_argument('-o', '--objects', action='store_true',
+                        help='count blocks instead of bytes')
+    parser.add_argument('profile')
+    args = parser.parse_args()
+
+    rate, stacks, mappings = readprofile(args.profile)
+    names = symbolize({pc for _, pcs in stacks for pc in pcs}, mappings)
+
+    folded = {}
+    for (live_count, live_bytes, count, size), pcs in stacks:
+        if not args.total:
+            count, size = live_count, live_bytes
+        if count == 0:
+            continue
+        bytes_ = unsample(count, size, rate)
+        value = bytes_ / (size / count) if args.objects else bytes_
+
+        frames = [names[pc] for pc in reversed(pcs) if names[pc]]
+        key = ';'.join(frames)
+        folded[key] = folded.get(key, 0) + value
+
+    for key, value in sorted(folded.items(), key=lambda kv: -kv[1]):
+        print('%s %d' % (key, round(value)))
@@ -0,0 +1,274 @@
+/*
+ * ipcbench.c - Message throughput between two processes: shared heap
+ *              against a pipe.
+ *
+ * The producer fills messages and the consumer reads every byte of them.
+ * With a pipe, each message is copied through the kernel. With a shared
+ * heap, the producer allocates messages with mm_malloc in a heap backed
+ * by a memory file (see mem_shared), and passes only their handles. The
+ * consumer maps the same file at its own address, reads the message in
+ * place and passes the handle back, so the producer can free it.
+ * Only the producer runs the allocator, so no lock is needed.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+#define MAX_INFLIGHT 256 /* messages sent but not yet returned */
+
+/* Fixed message sizes run when no -s is given */
+static const size_t default_sizes[] = {64, 1024, 16384, 65536};
+
+static void unix_error(const char *msg) {
+  fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * read_full, write_full - transfer exactly len bytes through a pipe
+ */
+static void read_full(int fd, void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n <= 0)
+      unix_error("read failed");
+    buf = (char *)buf + n;
+    len -= n;
+  }
+}
+
+static void write_full(int fd, const void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0)
+      unix_error("write failed");
+    buf = (const char *)buf + n;
+    len -= n;
+  }
+}
+
+/*
+ * fill, digest - producer writes and consumer reads the whole message
+ */
+static void fill(void *msg, size_t size, uint64_t seq) {
+  uint64_t *word = msg;
+
+  for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+    word[i] = seq + i;
+}
+
+static uint64_t digest(const void *msg, size_t size) {
+  const uint64_t *word = msg;
+  uint64_t sum = 0;
+
+  for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+    sum += word[i];
+  return sum;
+}
+
+/*
+ * expected - digest of message seq, which the consumer checks
+ */
+static uint64_t expected(size_t size, uint64_t seq) {
+  uint64_t n = size / sizeof(uint64_t);
+
+  return n * seq + n * (n - 1) / 2;
+}
+
+static double now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1E-6 * tv.tv_usec;
+}
+
+/*
+ * run_pipe - send count messages of given size through a pipe
+ */
+static double run_pipe(size_t size, long count) {
+  int data[2];
+  char *buf = malloc(size);
+
+  if (buf == NULL || pipe(data) < 0)
+    unix_error("pipe setup failed");
+
+  double start = now();
+  pid_t pid = fork();
+
+  if (pid < 0)
+    unix_error("fork failed");
+
+  if (pid == 0) {
+    close(data[1]);
+    for (long seq = 0; seq < count; seq++) {
+      read_full(data[0], buf, size);
+      if (digest(buf, size) != expected(size, seq))
+        _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(data[0]);
+  for (long seq = 0; seq < count; seq++) {
+    fill(buf, size, seq);
+    write_full(data[1], buf, size);
+  }
+  close(data[1]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "pipe consumer saw a corrupted message\n");
+    exit(EXIT_FAILURE);
+  }
+
+  free(buf);
+  return now() - start;
+}
+
+/*
+ * run_shared - send handles of count messages of given size allocated
+ *    in a shared heap, and free them when the consumer hands them back
+ */
+static double run_shared(size_t size, long count) {
+  int data[2], back[2];
+
+  mem_shared(1);
+  mem_init();
+  if (mem_fd() < 0 || mm_init() < 0) {
+    fprintf(stderr, "shared heap setup failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (pipe(data) < 0 || pipe(back) < 0)
+    unix_error("pipe setup failed");
+
+  double start = now();
+  pid_t pid = fork();
+
+  if (pid < 0)
+    unix_error("fork failed");
+
+  if (pid == 0) {
+    /* Map heap again, so handles are resolved at a different address */
+    void *base = mem_attach(mem_fd());
+    if (base == NULL)
+      _exit(EXIT_FAILURE);
+
+    close(data[1]);
+    close(back[0]);
+    for (long seq = 0; seq < count; seq++) {
+      mem_handle_t h;
+      read_full(data[0], &h, sizeof(h));
+      if (digest(mem_handle_ptr(base, h), size) != expected(size, seq))
+        _exit(EXIT_FAILURE);
+      write_full(back[1], &h, sizeof(h));
+    }
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(data[0]);
+  close(back[1]);
+
+  long inflight = 0;
+  for (long seq = 0; seq < count; seq++) {
+    mem_handle_t h;
+
+    /* Wait for consumer to return a message if too many are out */
+    if (inflight == MAX_INFLIGHT) {
+      read_full(back[0], &h, sizeof(h));
+      mm_free(mem_handle_ptr(mem_heap_lo(), h));
+      inflight--;
+    }
+
+    void *msg = mm_malloc(size);
+    if (msg == NULL) {
+      fprintf(stderr, "mm_malloc failed\n");
+      exit(EXIT_FAILURE);
+    }
+    fill(msg, size, seq);
+    h = mem_handle(msg);
+    write_full(data[1], &h, sizeof(h));
+    inflight++;
+  }
+  close(data[1]);
+
+  while (inflight-- > 0) {
+    mem_handle_t h;
+    read_full(back[0], &h, sizeof(h));
+    mm_free(mem_handle_ptr(mem_heap_lo(), h));
+  }
+  close(back[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "shared heap consumer saw a corrupted message\n");
+    exit(EXIT_FAILURE);
+  }
+
+  double secs = now() - start;
+  mem_deinit();
+  return secs;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: ipcbench [-h] [-n <msgs>] [-s <size>]\n");
+  fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-h         Print this message.\n");
+  fprintf(stderr, "\t-n <msgs>  Send <msgs> messages per run.\n");
+  fprintf(stderr, "\t-s <size>  Use messages of <size> bytes only.\n");
+}
+
+int main(int argc, char **argv) {
+  long count = 100000;
+  size_t size = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "hn:s:")) != EOF) {
+    switch (c) {
+      case 'n':
+        count = atol(optarg);
+        break;
+
+      case 's':
+        size = atol(optarg);
+        if (size == 0) {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'h':
+        usage();
+        exit(EXIT_SUCCESS);
+
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  const size_t *sizes = size ? &size : default_sizes;
+  int nsizes = size ? 1 : sizeof(default_sizes) / sizeof(default_sizes[0]);
+
+  printf("%8s %8s %14s %14s %8s\n", "size", "msgs", "pipe Kmsg/s",
+         "shared Kmsg/s", "speedup");
+  for (int i = 0; i < nsizes; i++) {
+    double pipe_secs = run_pipe(sizes[i], count);
+    double shared_secs = run_shared(sizes[i], count);
+    printf("%8zu %8ld %14.0f %14.0f %7.2fx\n", sizes[i], count,
+           count / 1e3 / pipe_secs, count / 1e3 / shared_secs,
+           pipe_secs / shared_secs);
+  }
+
+  return EXIT_SUCCESS;
+}
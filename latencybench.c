@@ -0,0 +1,196 @@
+/*
+ * latencybench.c - Latency of malloc and free calls made by many threads,
+ *                  for libc malloc or anything preloaded in its place.
+ *
+ * Every thread keeps a table of blocks and, at random, frees a block or
+ * allocates one in an empty slot. Sizes are mostly small, with a few
+ * large blocks that make the heap grow and shrink. Every call is timed,
+ * and percentiles of all threads together are printed. Run it plain and
+ * with LD_PRELOAD=./libmm.so, with and without MM_MAINTAIN, to see what
+ * the maintenance thread does to the tail.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXTHREADS 64
+#define SLOTS 4096 /* blocks held by a thread at most */
+
+typedef struct {
+  long ops;
+  unsigned long seed;
+  long *malloc_ns; /* latency of every malloc */
+  long *free_ns;   /* latency of every free */
+  long mallocs;
+  long frees;
+} worker_t;
+
+static long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Linear congruential generator, every thread has its own */
+static unsigned long next_random(unsigned long *seed) {
+  *seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+  return *seed >> 33;
+}
+
+/*
+ * random_size - 16 to 1024 bytes mostly, 64 KiB to 1 MiB now and then
+ */
+static size_t random_size(unsigned long *seed) {
+  unsigned long r = next_random(seed);
+
+  if (r % 1000 == 0)
+    return (64 << 10) + r % (960 << 10);
+  return 16 + r % 1008;
+}
+
+static void *worker(void *arg) {
+  worker_t *w = arg;
+  char *slots[SLOTS] = {};
+
+  for (long i = 0; i < w->ops; i++) {
+    int slot = next_random(&w->seed) % SLOTS;
+
+    if (slots[slot]) {
+      long start = now_ns();
+      free(slots[slot]);
+      w->free_ns[w->frees++] = now_ns() - start;
+      slots[slot] = NULL;
+    } else {
+      size_t size = random_size(&w->seed);
+      long start = now_ns();
+      slots[slot] = malloc(size);
+      w->malloc_ns[w->mallocs++] = now_ns() - start;
+      if (slots[slot] == NULL) {
+        fprintf(stderr, "malloc(%zu) failed\n", size);
+        exit(EXIT_FAILURE);
+      }
+      memset(slots[slot], i, size < 64 ? size : 64);
+    }
+  }
+
+  for (int slot = 0; slot < SLOTS; slot++)
+    free(slots[slot]);
+  return NULL;
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * report - print percentiles of latencies gathered from all threads
+ */
+static void report(const char *name, worker_t *workers, int nthreads,
+                   int is_free) {
+  long n = 0;
+
+  for (int i = 0; i < nthreads; i++)
+    n += is_free ? workers[i].frees : workers[i].mallocs;
+
+  long *all = malloc(n * sizeof(long));
+  if (all == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  long k = 0;
+  for (int i = 0; i < nthreads; i++) {
+    long m = is_free ? workers[i].frees : workers[i].mallocs;
+    memcpy(all + k, is_free ? workers[i].free_ns : workers[i].malloc_ns,
+           m * sizeof(long));
+    k += m;
+  }
+  qsort(all, n, sizeof(long), compare_long);
+
+  printf("%-7s %9ld %8ld %8ld %8ld %8ld\n", name, n, all[n / 2],
+         all[n * 99 / 100], all[n * 999 / 1000], all[n - 1]);
+  free(all);
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: latencybench [-h] [-n <ops>] [-t <threads>]\n");
+  fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-h            Print this message.\n");
+  fprintf(stderr, "\t-n <ops>      Make <ops> calls in each thread.\n");
+  fprintf(stderr, "\t-t <threads>  Run <threads> threads.\n");
+}
+
+int main(int argc, char **argv) {
+  pthread_t tids[MAXTHREADS];
+  worker_t workers[MAXTHREADS];
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  long ops = 1000000;
+  int c;
+
+  while ((c = getopt(argc, argv, "hn:t:")) != EOF) {
+    switch (c) {
+      case 'n':
+        ops = atol(optarg);
+        break;
+
+      case 't':
+        nthreads = atoi(optarg);
+        break;
+
+      case 'h':
+        usage();
+        exit(EXIT_SUCCESS);
+
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (nthreads < 1 || nthreads > MAXTHREADS || ops < 1) {
+    fprintf(stderr, "number of threads must be between 1 and %d\n",
+            MAXTHREADS);
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    workers[i] = (worker_t){.ops = ops, .seed = i + 1};
+    workers[i].malloc_ns = malloc(ops * sizeof(long));
+    workers[i].free_ns = malloc(ops * sizeof(long));
+    if (workers[i].malloc_ns == NULL || workers[i].free_ns == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  long start = now_ns();
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&tids[i], NULL, worker, &workers[i]) != 0) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(tids[i], NULL);
+  double secs = (now_ns() - start) / 1e9;
+
+  printf("%d threads, %ld calls each, %.0f Kops/s\n", nthreads, ops,
+         nthreads * ops / secs / 1e3);
+  printf("%-7s %9s %8s %8s %8s %8s\n", "ns", "calls", "p50", "p99", "p99.9",
+         "max");
+  report("malloc", workers, nthreads, 0);
+  report("free", workers, nthreads, 1);
+
+  for (int i = 0; i < nthreads; i++) {
+    free(workers[i].malloc_ns);
+    free(workers[i].free_ns);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,1186 @@
+/*
+ * libmm.c - mm.c as a drop-in replacement for the malloc of libc, built
+ *           into libmm.so and loaded with LD_PRELOAD=./libmm.so.
+ *
+ * The heap lives in memory reserved from the OS on first use instead of
+ * the simulated region of memlib.c. Every entry point takes one lock
+ * around mm.c, which is otherwise single threaded, and sets up the heap
+ * the first time it is called, since nothing calls mm_init in a program
+ * that was not written for this allocator. The rest of the glibc malloc
+ * surface (posix_memalign, aligned_alloc, valloc, pvalloc, reallocarray
+ * and malloc_usable_size) is built from the calls of mm.c. Only those
+ * functions are exported, everything else in the library is hidden.
+ *
+ * Setting MM_MAINTAIN starts a maintenance thread that takes work off
+ * the request path, see maintain. Its counters are printed at exit if
+ * MM_MAINTAIN_STATS is set too. Setting MM_PROFILE turns on a sampling
+ * heap profiler, see profile_malloc. Setting MM_RECORD to a file name
+ * records every call into a trace that mdriver replays, see
+ * record_request.
+ *
+ * mm.c is built with its default best fit over the size index. Free is
+ * constant time, but every malloc without an exact fit scans the sizes
+ * of all free blocks, so programs that keep thousands of free blocks pay
+ * for all of them on every call. Compare a program against glibc with
+ * preload.py.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/*
+ * Block sizes and free list links in mm.c are 32 bits wide, so the heap
+ * is at most 4 GB. The Makefile builds mm.c and this file with that
+ * HEAP_LIMIT, which also sizes the size index of mm.c. Smaller
+ * reservations are tried if the system refuses one that large. Requests
+ * are capped well below it, so that sizes with alignment and overhead
+ * added stay representable.
+ */
+#define OS_HEAP_MIN (1UL << 26)
+#define MAX_REQUEST (HEAP_LIMIT / 2)
+
+/* Maintenance thread, see maintain */
+#define MAINT_INTERVAL 1000000L /* shortest nap between passes (ns) */
+#define DEFER_MAX 1024          /* deferred frees before free does its own */
+#define DRAIN_BATCH 256         /* deferred frees done per lock hold */
+#define TRIM_EVERY 100          /* passes between trims */
+#define TRIM_MIN (1 << 16)      /* smallest free block trimmed */
+#define TRIM_BATCH 256          /* free blocks looked at per lock hold */
+#define PREFAULT_MAX (1 << 24)  /* most bytes touched past the break */
+
+/* Heap profiler, see profile_malloc */
+#define PROFILE_RATE (512 << 10) /* default mean bytes between samples */
+#define PROFILE_DEPTH 32         /* frames kept of a stack */
+#define PROFILE_SKIP 2           /* frames of the profiler and malloc */
+#define PROFILE_STACKS 4096      /* distinct stacks, power of two */
+#define PROFILE_SAMPLES 65536    /* live samples, power of two */
+#define PROFILE_FILTER 65536     /* counters of the sampled pointer filter */
+
+/* Recorder, see record_request */
+#define RECORD_BUF (1 << 20) /* bytes of requests buffered before a write */
+#define RECORD_IDS (1 << 22) /* live blocks tracked, power of two */
+#define RECORD_THREADS 256   /* thread numbers, as many as mdriver -P runs */
+
+/* OS backed heap */
+static char *heap;
+static char *heap_brk;
+static char *heap_max;
+static unsigned char heap_roots[MEM_ROOTS_SIZE];
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool heap_ready; /* heap reserved and mm_init done */
+
+/* Maintenance thread state */
+static bool maintained;      /* thread is running in this process */
+static int maint_budget;     /* percent of a CPU the thread may use */
+static void *deferred;       /* frees not done yet, linked through payload */
+static long deferred_count;  /* length of that list */
+static char *heap_populated; /* pages touched ahead of the break end here */
+
+static struct {
+  unsigned long passes;        /* times the thread woke up */
+  unsigned long deferred;      /* frees done by the thread */
+  unsigned long overflowed;    /* frees done by free, list was full */
+  unsigned long trimmed;       /* bytes given back with madvise */
+  unsigned long prefaulted;    /* bytes touched ahead of the break */
+  unsigned long cpu_ns;        /* CPU time of the thread */
+} maint_stats;
+
+/*
+ * heap_reserve - reserve address space for the heap. Pages are backed
+ *    by memory only when first touched, so reserving is cheap.
+ */
+static int heap_reserve(void) {
+  for (size_t len = HEAP_LIMIT; len >= OS_HEAP_MIN; len /= 2) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p != MAP_FAILED) {
+      heap = heap_brk = p;
+      heap_max = heap + len;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Memory source for mm.c, the subset of memlib.h it calls. There is no
+ * file behind this heap, so roots are kept in memory and never synced,
+ * and the heap is never unmapped. Errors are not printed, since stdio may call malloc.
+ */
+void *mem_sbrk(long incr) {
+  char *old_brk = heap_brk;
+
+  if (incr < 0 || incr > heap_max - heap_brk) {
+    errno = ENOMEM;
+    return (void *)-1;
+  }
+
+  heap_brk += incr;
+  return old_brk;
+}
+
+void *mem_heap_lo(void) {
+  return heap;
+}
+
+void *mem_heap_hi(void) {
+  return heap_brk - 1;
+}
+
+size_t mem_heapsize(void) {
+  return heap_brk - heap;
+}
+
+size_t mem_pagesize(void) {
+  return getpagesize();
+}
+
+void *mem_roots(void) {
+  return heap_roots;
+}
+
+int mem_sync(void) {
+  return -1;
+}
+
+int mem_sync_meta(void) {
+  return -1;
+}
+
+void mem_deinit(void) {}
+
+/*
+ * heap_enter - take the heap lock, setting the heap up on the first call.
+ *    Returns false with errno set and the lock released on failure.
+ */
+static inline bool heap_enter(void) {
+  pthread_mutex_lock(&heap_lock);
+  if (__builtin_expect(!heap_ready, 0)) {
+    if (heap == NULL && heap_reserve() < 0) {
+      pthread_mutex_unlock(&heap_lock);
+      errno = ENOMEM;
+      return false;
+    }
+    if (mm_init() < 0) {
+      heap_brk = heap;
+      pthread_mutex_unlock(&heap_lock);
+      errno = ENOMEM;
+      return false;
+    }
+    heap_ready = true;
+  }
+  return true;
+}
+
+static inline void heap_leave(void) {
+  pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * in_heap - check if ptr points into the heap. Memory handed out before
+ *    this library was loaded (e.g. by the dynamic loader) is not ours.
+ */
+static inline bool in_heap(void *ptr) {
+  return (char *)ptr >= heap && (char *)ptr < heap_brk;
+}
+
+/*
+ * drain - free all deferred blocks, DRAIN_BATCH at a time so that the
+ *    heap lock is not held for long, and add their number to counter
+ */
+static void drain(unsigned long *counter) {
+  void *bp = __atomic_exchange_n(&deferred, NULL, __ATOMIC_ACQUIRE);
+
+  while (bp) {
+    long n = 0;
+    pthread_mutex_lock(&heap_lock);
+    for (; bp && n < DRAIN_BATCH; n++) {
+      void *next = *(void **)bp;
+      mm_free(bp);
+      bp = next;
+    }
+    heap_leave();
+    __atomic_sub_fetch(&deferred_count, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * defer_free - put a block on the list of deferred frees. Pushing takes
+ *    no lock, the list is only ever taken as a whole by drain. When the
+ *    list is full the caller frees its own block and leaves the list to
+ *    the thread, so no free pays for more than one mm_free.
+ */
+static void defer_free(void *ptr) {
+  if (__atomic_load_n(&deferred_count, __ATOMIC_RELAXED) >= DEFER_MAX) {
+    pthread_mutex_lock(&heap_lock);
+    mm_free(ptr);
+    heap_leave();
+    __atomic_add_fetch(&maint_stats.overflowed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  void *head = __atomic_load_n(&deferred, __ATOMIC_RELAXED);
+
+  do {
+    *(void **)ptr = head;
+  } while (!__atomic_compare_exchange_n(&deferred, &head, ptr, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  __atomic_add_fetch(&deferred_count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * trim - give back pages of free blocks of at least TRIM_MIN bytes, one
+ *    batch per lock hold, until every free block was looked at once
+ */
+static void trim(void) {
+  mm_stats_t stats;
+
+  pthread_mutex_lock(&heap_lock);
+  mm_stats(&stats);
+  heap_leave();
+
+  for (size_t n = 0; n <= stats.free_blocks; n += TRIM_BATCH) {
+    pthread_mutex_lock(&heap_lock);
+    maint_stats.trimmed += mm_trim(TRIM_MIN, TRIM_BATCH);
+    heap_leave();
+  }
+}
+
+/*
+ * prefault - touch pages past the break, twice as many as the heap grew
+ *    since the last pass, so the page faults of the next extensions are
+ *    taken here and not in malloc. Pages past the break belong to no
+ *    block, so no lock is needed.
+ */
+static void prefault(char **last_brk) {
+#ifdef MADV_POPULATE_WRITE
+  size_t page = getpagesize();
+  char *brk = __atomic_load_n(&heap_brk, __ATOMIC_RELAXED);
+  size_t growth = brk - *last_brk;
+
+  *last_brk = brk;
+  if (growth == 0)
+    return;
+
+  uintptr_t from = (uintptr_t)MAX(brk, heap_populated) & ~(page - 1);
+  uintptr_t to = (uintptr_t)brk + MIN(2 * growth, PREFAULT_MAX);
+  to = MIN((to + page - 1) & ~(page - 1), (uintptr_t)heap_max);
+  if (to <= from)
+    return;
+
+  if (madvise((void *)from, to - from, MADV_POPULATE_WRITE) == 0) {
+    maint_stats.prefaulted += to - from;
+    heap_populated = (char *)to;
+  }
+#endif
+}
+
+static long thread_cpu_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * maintain - body of the maintenance thread. With it running, free only
+ *    defers blocks, and the thread frees them in batches, so coalescing
+ *    is not paid by the caller. Every TRIM_EVERY passes it gives back
+ *    pages of large free blocks, and it prefaults pages ahead of heap
+ *    growth. After each pass it naps long enough to keep its CPU time
+ *    within maint_budget percent.
+ */
+static void *maintain(void *arg) {
+  char *last_brk = heap_brk;
+
+  for (unsigned long pass = 1;; pass++) {
+    long start = thread_cpu_ns();
+
+    drain(&maint_stats.deferred);
+    if (heap_ready) {
+      prefault(&last_brk);
+      if (pass % TRIM_EVERY == 0)
+        trim();
+    }
+
+    long spent = thread_cpu_ns() - start;
+    maint_stats.cpu_ns += spent;
+    maint_stats.passes++;
+
+    long nap = MAX(MAINT_INTERVAL, spent * 100 / maint_budget - spent);
+    struct timespec ts = {nap / 1000000000L, nap % 1000000000L};
+    nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+/*
+ * Sampling heap profiler, started when MM_PROFILE is set to the mean
+ * number of bytes allocated between samples (PROFILE_RATE if empty).
+ * Each thread counts down bytes to its next sample, drawn from an
+ * exponential distribution, so every byte is equally likely to be
+ * sampled (Poisson sampling) and big blocks are sampled more often. A
+ * sampled block gets the backtrace of its allocation, kept once per
+ * distinct stack, and an entry keyed by its pointer in a table of live
+ * samples, which free removes again. A free checks a counting filter of
+ * sampled pointers first, so only a few take the profile lock.
+ *
+ * The profile is written in the legacy heap format of pprof, marked
+ * heap_v2 as gperftools does for Poisson sampling so that pprof unsamples
+ * it with the mean rate, with the maps of the process, to
+ * <MM_PROFILE_FILE or "libmm">.<pid>.<n>.heap at exit, after SIGUSR2 (by
+ * the next malloc or free) and whenever the program calls mm_profile_dump.
+ * heapprof.py turns it into folded stacks for flame graphs.
+ */
+static bool profiling;            /* MM_PROFILE is set */
+static long profile_rate;         /* mean bytes between samples */
+static const char *profile_file;  /* prefix of profile file names */
+static volatile sig_atomic_t profile_requested; /* set by SIGUSR2 */
+static int profile_seq;           /* profiles written so far */
+
+typedef struct {
+  unsigned long hash;
+  int depth;
+  void *pcs[PROFILE_DEPTH];
+  unsigned long live_count; /* sampled blocks that were not freed */
+  unsigned long live_bytes;
+  unsigned long total_count; /* all sampled blocks */
+  unsigned long total_bytes;
+} profile_stack_t;
+
+typedef struct {
+  void *ptr; /* sampled block, NULL in empty entries */
+  size_t size;
+  profile_stack_t *stack;
+} profile_sample_t;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static profile_stack_t *profile_stacks;   /* PROFILE_STACKS, by hash */
+static profile_sample_t *profile_samples; /* PROFILE_SAMPLES, by pointer */
+static unsigned short profile_filter[PROFILE_FILTER]; /* samples by hash */
+static unsigned long profile_dropped; /* samples the tables had no room for */
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+static TLS long sample_left;       /* bytes to go until next sample */
+static TLS bool sample_started;    /* sample_left was drawn */
+static TLS bool in_profiler;       /* backtrace may call malloc */
+static TLS unsigned long sample_seed;
+
+static inline size_t ptr_hash(void *ptr) {
+  return ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15UL >> 32;
+}
+
+/*
+ * sample_interval - draw bytes to the next sample, exponential with mean
+ *    profile_rate
+ */
+static long sample_interval(void) {
+  if (sample_seed == 0)
+    sample_seed = (uintptr_t)&sample_seed ^ (unsigned long)time(NULL);
+  sample_seed = sample_seed * 6364136223846793005UL + 1442695040888963407UL;
+  double u = ((sample_seed >> 11) + 1) / 9007199254740993.0; /* (0, 1] */
+  return -log(u) * profile_rate + 1;
+}
+
+/*
+ * profile_stack - find or add stack with given frames, or return NULL if
+ *    the table is full
+ */
+static profile_stack_t *profile_stack(void **pcs, int depth) {
+  unsigned long hash = depth;
+
+  for (int i = 0; i < depth; i++)
+    hash = (hash ^ (uintptr_t)pcs[i]) * 0x100000001b3UL;
+
+  for (size_t n = 0, i = hash; n < PROFILE_STACKS; n++, i++) {
+    profile_stack_t *s = &profile_stacks[i & (PROFILE_STACKS - 1)];
+    if (s->depth == 0) {
+      s->hash = hash;
+      s->depth = depth;
+      memcpy(s->pcs, pcs, depth * sizeof(void *));
+      return s;
+    }
+    if (s->hash == hash && s->depth == depth &&
+        memcmp(s->pcs, pcs, depth * sizeof(void *)) == 0)
+      return s;
+  }
+  return NULL;
+}
+
+/*
+ * profile_record - add sampled block with the stack of its allocation
+ */
+static void profile_record(void *ptr, size_t size) {
+  void *pcs[PROFILE_DEPTH + PROFILE_SKIP];
+
+  in_profiler = true;
+  int depth = backtrace(pcs, PROFILE_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+  in_profiler = false;
+  if (depth <= 0)
+    return;
+
+  pthread_mutex_lock(&profile_lock);
+  profile_stack_t *stack = profile_stack(pcs + PROFILE_SKIP, depth);
+  size_t i = ptr_hash(ptr);
+  size_t n = 0;
+
+  while (n < PROFILE_SAMPLES / 2 &&
+         profile_samples[i & (PROFILE_SAMPLES - 1)].ptr) {
+    i++;
+    n++;
+  }
+
+  if (stack == NULL || n == PROFILE_SAMPLES / 2) {
+    profile_dropped++;
+  } else {
+    profile_sample_t *s = &profile_samples[i & (PROFILE_SAMPLES - 1)];
+    *s = (profile_sample_t){ptr, size, stack};
+    stack->live_count++;
+    stack->live_bytes += size;
+    stack->total_count++;
+    stack->total_bytes += size;
+    __atomic_add_fetch(&profile_filter[ptr_hash(ptr) % PROFILE_FILTER], 1,
+                       __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+ * profile_forget - remove block from live samples if it is there. Entries
+ *    after the removed one are shifted back, so lookups need no markers.
+ */
+static void profile_forget(void *ptr) {
+  pthread_mutex_lock(&profile_lock);
+  size_t i = ptr_hash(ptr);
+
+  for (;; i++) {
+    profile_sample_t *s = &profile_samples[i & (PROFILE_SAMPLES - 1)];
+    if (s->ptr == NULL) {
+      pthread_mutex_unlock(&profile_lock);
+      return;
+    }
+    if (s->ptr == ptr)
+      break;
+  }
+
+  profile_sample_t *s = &profile_samples[i & (PROFILE_SAMPLES - 1)];
+  s->stack->live_count--;
+  s->stack->live_bytes -= s->size;
+  __atomic_sub_fetch(&profile_filter[ptr_hash(ptr) % PROFILE_FILTER], 1,
+                     __ATOMIC_RELAXED);
+
+  for (size_t j = i + 1;; j++) {
+    profile_sample_t *next = &profile_samples[j & (PROFILE_SAMPLES - 1)];
+    if (next->ptr == NULL)
+      break;
+    size_t home = ptr_hash(next->ptr);
+    /* Entry may move to the hole at i only if its home is not in (i, j] */
+    if (((j - home) & (PROFILE_SAMPLES - 1)) >=
+        ((j - i) & (PROFILE_SAMPLES - 1))) {
+      profile_samples[i & (PROFILE_SAMPLES - 1)] = *next;
+      i = j;
+    }
+  }
+  profile_samples[i & (PROFILE_SAMPLES - 1)].ptr = NULL;
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+ * write_all - write whole buffer, or fail
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * profile_write - write profile to fd. Uses neither malloc nor stdio
+ *    streams, so it can run inside the allocator.
+ */
+static int profile_write(int fd) {
+  unsigned long live_count = 0, live_bytes = 0;
+  unsigned long total_count = 0, total_bytes = 0;
+  char line[64 + 20 * PROFILE_DEPTH];
+  int len, err = 0;
+
+  pthread_mutex_lock(&profile_lock);
+  for (size_t i = 0; i < PROFILE_STACKS; i++) {
+    live_count += profile_stacks[i].live_count;
+    live_bytes += profile_stacks[i].live_bytes;
+    total_count += profile_stacks[i].total_count;
+    total_bytes += profile_stacks[i].total_bytes;
+  }
+
+  len = snprintf(line, sizeof(line),
+                 "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%ld\n",
+                 live_count, live_bytes, total_count, total_bytes,
+                 profile_rate);
+  err |= write_all(fd, line, len);
+
+  for (size_t i = 0; i < PROFILE_STACKS && !err; i++) {
+    profile_stack_t *s = &profile_stacks[i];
+    if (s->total_count == 0)
+      continue;
+    len = snprintf(line, sizeof(line), "%lu: %lu [%lu: %lu] @", s->live_count,
+                   s->live_bytes, s->total_count, s->total_bytes);
+    for (int d = 0; d < s->depth; d++)
+      len += snprintf(line + len, sizeof(line) - len, " %p", s->pcs[d]);
+    line[len++] = '\n';
+    err |= write_all(fd, line, len);
+  }
+  pthread_mutex_unlock(&profile_lock);
+
+  /* Maps let pprof and heapprof.py find the code behind addresses */
+  int maps = open("/proc/self/maps", O_RDONLY);
+  if (maps < 0)
+    return -1;
+  err |= write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+  while (!err && (len = read(maps, line, sizeof(line))) > 0)
+    err |= write_all(fd, line, len);
+  close(maps);
+
+  return err ? -1 : 0;
+}
+
+/*
+ * mm_profile_dump - write profile to path, or to the next numbered file
+ *    if path is NULL. Exported, so programs can find it with dlsym.
+ */
+EXPORT int mm_profile_dump(const char *path) {
+  char name[PATH_MAX];
+
+  if (!profiling)
+    return -1;
+  if (path == NULL) {
+    snprintf(name, sizeof(name), "%s.%d.%04d.heap", profile_file, getpid(),
+             __atomic_fetch_add(&profile_seq, 1, __ATOMIC_RELAXED));
+    path = name;
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+  int err = profile_write(fd);
+  close(fd);
+  return err;
+}
+
+static void profile_signal(int sig) {
+  profile_requested = 1;
+}
+
+/*
+ * profile_poll - write the profile asked for with SIGUSR2
+ */
+static inline void profile_poll(void) {
+  if (__builtin_expect(profile_requested, 0)) {
+    profile_requested = 0;
+    mm_profile_dump(NULL);
+  }
+}
+
+/*
+ * profile_malloc - count size against the sample interval of the thread
+ *    and sample the block when it runs out. The first interval of each
+ *    thread is only drawn here, so threads do not all sample their first
+ *    block.
+ */
+static inline void profile_malloc(void *ptr, size_t size) {
+  if (__builtin_expect(!profiling || ptr == NULL || in_profiler, 1))
+    return;
+
+  profile_poll();
+  if ((sample_left -= size) >= 0)
+    return;
+  if (sample_started)
+    profile_record(ptr, size);
+  sample_started = true;
+  sample_left = sample_interval();
+}
+
+/*
+ * profile_free - forget block about to be freed if it was sampled
+ */
+static inline void profile_free(void *ptr) {
+  if (__builtin_expect(!profiling, 1))
+    return;
+
+  profile_poll();
+  if (profile_filter[ptr_hash(ptr) % PROFILE_FILTER])
+    profile_forget(ptr);
+}
+
+/*
+ * profile_init - set the profiler up if MM_PROFILE asks for it. Called
+ *    from libmm_init, before the program runs.
+ */
+static void profile_init(void) {
+  const char *rate = getenv("MM_PROFILE");
+  if (rate == NULL)
+    return;
+
+  profile_rate = atol(rate) > 0 ? atol(rate) : PROFILE_RATE;
+  profile_file = getenv("MM_PROFILE_FILE") ?: "libmm";
+
+  profile_stacks = mmap(NULL, PROFILE_STACKS * sizeof(profile_stack_t),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  profile_samples = mmap(NULL, PROFILE_SAMPLES * sizeof(profile_sample_t),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (profile_stacks == MAP_FAILED || profile_samples == MAP_FAILED)
+    return;
+
+  /* First backtrace loads the unwinder, which allocates */
+  void *pcs[1];
+  in_profiler = true;
+  backtrace(pcs, 1);
+  in_profiler = false;
+
+  signal(SIGUSR2, profile_signal);
+  profiling = true;
+}
+
+/*
+ * Recorder, started when MM_RECORD names a file. Every call is written to
+ * it as a request of the trace format of mdriver, after the number of the
+ * calling thread and the ns since recording started:
+ *
+ *   <thread> <ns> a <id> <size>               malloc, calloc
+ *   <thread> <ns> m <id> <alignment> <size>   memalign and friends
+ *   <thread> <ns> r <id> <size>               realloc
+ *   <thread> <ns> f <id>                      free
+ *
+ * Blocks get ids in the order they are allocated, and are found again by
+ * pointer in a table of live blocks. Frees are recorded before the block
+ * is freed (or deferred) and allocations after the block is handed out,
+ * so the lines come in an order the calls can be replayed in. Realloc,
+ * which does both, is recorded under the heap lock. The header is padded
+ * and rewritten at exit, once the number of ids and requests is known.
+ * mdriver -P replays the trace with a thread per recorded thread.
+ */
+static bool recording;       /* MM_RECORD is set */
+static int record_fd;        /* trace being written */
+static long record_start;    /* ns when recording started */
+static int record_next_id;   /* id of next allocated block */
+static long record_ops;      /* requests written */
+static long record_live;     /* blocks in record_ids */
+static unsigned long record_dropped; /* calls the table had no room for */
+
+typedef struct {
+  void *ptr; /* recorded block, NULL in empty entries */
+  int id;
+} record_id_t;
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static record_id_t *record_ids; /* RECORD_IDS, by pointer */
+static char record_buf[RECORD_BUF];
+static size_t record_len;
+
+static int record_users[RECORD_THREADS]; /* live threads by number */
+static pthread_key_t record_key;          /* gives number back at exit */
+static TLS int record_thread; /* number of thread + 1, 0 if not seen yet */
+
+static long monotonic_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * record_bind - enter block ptr with id into the table of live blocks
+ */
+static void record_bind(void *ptr, int id) {
+  size_t i = ptr_hash(ptr);
+
+  while (record_ids[i & (RECORD_IDS - 1)].ptr != NULL)
+    i++;
+  record_ids[i & (RECORD_IDS - 1)] = (record_id_t){ptr, id};
+  record_live++;
+}
+
+/*
+ * record_unbind - remove block ptr from the table and return its id, -1
+ *    if it was not recorded. Shifts entries back like profile_forget.
+ */
+static int record_unbind(void *ptr) {
+  size_t i = ptr_hash(ptr);
+
+  for (;; i++) {
+    record_id_t *e = &record_ids[i & (RECORD_IDS - 1)];
+    if (e->ptr == NULL)
+      return -1;
+    if (e->ptr == ptr)
+      break;
+  }
+
+  int id = record_ids[i & (RECORD_IDS - 1)].id;
+  for (size_t j = i + 1;; j++) {
+    record_id_t *next = &record_ids[j & (RECORD_IDS - 1)];
+    if (next->ptr == NULL)
+      break;
+    size_t home = ptr_hash(next->ptr);
+    if (((j - home) & (RECORD_IDS - 1)) >= ((j - i) & (RECORD_IDS - 1))) {
+      record_ids[i & (RECORD_IDS - 1)] = *next;
+      i = j;
+    }
+  }
+  record_ids[i & (RECORD_IDS - 1)].ptr = NULL;
+  record_live--;
+  return id;
+}
+
+/*
+ * record_flush - write out buffered requests
+ */
+static void record_flush(void) {
+  if (write_all(record_fd, record_buf, record_len) < 0)
+    recording = false;
+  record_len = 0;
+}
+
+/*
+ * record_thread_exit - give the number of an exiting thread back
+ */
+static void record_thread_exit(void *arg) {
+  pthread_mutex_lock(&record_lock);
+  record_users[(intptr_t)arg - 1]--;
+  pthread_mutex_unlock(&record_lock);
+  record_thread = 0;
+}
+
+/*
+ * record_enter - take the record lock. A thread gets a number on its first
+ *    request, the one with fewest live threads, so numbers of exited
+ *    threads are used again and more than RECORD_THREADS live threads
+ *    share them. The key was made in record_init, among the first ones,
+ *    which glibc keeps without allocating.
+ */
+static void record_enter(void) {
+  if (__builtin_expect(record_thread == 0, 0)) {
+    int n = 0;
+    pthread_mutex_lock(&record_lock);
+    for (int i = 1; i < RECORD_THREADS && record_users[n] > 0; i++)
+      if (record_users[i] < record_users[n])
+        n = i;
+    record_users[n]++;
+    pthread_mutex_unlock(&record_lock);
+    record_thread = n + 1;
+    pthread_setspecific(record_key, (void *)(intptr_t)record_thread);
+  }
+  pthread_mutex_lock(&record_lock);
+}
+
+/*
+ * record_request - append a request to the buffer, with thread and time
+ *    in front of it. Called with the record lock held.
+ */
+__attribute__((format(printf, 1, 2))) static void
+record_request(const char *fmt, ...) {
+  va_list ap;
+
+  if (record_len > RECORD_BUF - 128)
+    record_flush();
+
+  record_len += snprintf(record_buf + record_len, RECORD_BUF - record_len,
+                         "%d %ld ", record_thread - 1,
+                         monotonic_ns() - record_start);
+  va_start(ap, fmt);
+  record_len += vsnprintf(record_buf + record_len, RECORD_BUF - record_len,
+                          fmt, ap);
+  va_end(ap);
+  record_ops++;
+}
+
+/*
+ * record_alloc - give block handed out by malloc (alignment 0) or
+ *    memalign a new id and record the call
+ */
+static void record_alloc(void *ptr, size_t alignment, size_t size) {
+  if (__builtin_expect(!recording || ptr == NULL, 1))
+    return;
+
+  record_enter();
+  if (!recording) {
+    pthread_mutex_unlock(&record_lock);
+    return;
+  }
+  if (record_live >= RECORD_IDS / 4 * 3) {
+    record_dropped++;
+    pthread_mutex_unlock(&record_lock);
+    return;
+  }
+
+  int id = record_next_id++;
+  record_bind(ptr, id);
+  if (alignment)
+    record_request("m %d %zu %zu\n", id, alignment, size);
+  else
+    record_request("a %d %zu\n", id, size);
+  pthread_mutex_unlock(&record_lock);
+}
+
+/*
+ * record_realloc - move id of ptr to new_ptr and record the call. Blocks
+ *    allocated before recording started are recorded as new ones.
+ */
+static void record_realloc(void *ptr, void *new_ptr, size_t size) {
+  if (__builtin_expect(!recording || new_ptr == NULL, 1))
+    return;
+
+  record_enter();
+  int id = recording ? record_unbind(ptr) : -1;
+  if (id >= 0) {
+    record_bind(new_ptr, id);
+    record_request("r %d %zu\n", id, size);
+  }
+  pthread_mutex_unlock(&record_lock);
+  if (id < 0)
+    record_alloc(new_ptr, 0, size);
+}
+
+/*
+ * record_free - record the call if the block was recorded
+ */
+static void record_free(void *ptr) {
+  if (__builtin_expect(!recording, 1))
+    return;
+
+  record_enter();
+  int id = recording ? record_unbind(ptr) : -1;
+  if (id >= 0)
+    record_request("f %d\n", id);
+  pthread_mutex_unlock(&record_lock);
+}
+
+/*
+ * record_header - write the header of the trace, padded so that it can
+ *    be written again in place at the end
+ */
+static int record_header(void) {
+  char header[64];
+  int len = snprintf(header, sizeof(header), "%-10d\n%-10d\n%-20ld\n%-10d\n",
+                     1, record_next_id, record_ops, 0);
+  return pwrite(record_fd, header, len, 0) == len ? 0 : -1;
+}
+
+/*
+ * record_init - open the trace if MM_RECORD asks for it. Called from
+ *    libmm_init, before the program runs.
+ */
+static void record_init(void) {
+  const char *path = getenv("MM_RECORD");
+  if (path == NULL)
+    return;
+
+  record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (record_fd < 0)
+    return;
+  record_ids = mmap(NULL, RECORD_IDS * sizeof(record_id_t),
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (record_ids == MAP_FAILED || record_header() < 0 ||
+      lseek(record_fd, 0, SEEK_END) < 0 ||
+      pthread_key_create(&record_key, record_thread_exit)) {
+    close(record_fd);
+    return;
+  }
+
+  record_start = monotonic_ns();
+  recording = true;
+}
+
+/*
+ * record_fini - write the rest of the trace and its final header
+ */
+static void record_fini(void) {
+  pthread_mutex_lock(&record_lock);
+  if (recording) {
+    recording = false;
+    record_flush();
+    record_header();
+    close(record_fd);
+    if (record_dropped)
+      fprintf(stderr, "libmm: %lu calls not recorded, too many live blocks\n",
+              record_dropped);
+  }
+  pthread_mutex_unlock(&record_lock);
+}
+
+/*
+ * Fork handlers - the child gets the heap in a consistent state, since
+ *    no other thread can be inside mm.c while the lock is held. There is
+ *    no maintenance thread in the child, so it does deferred frees itself,
+ *    once; the list holds about DEFER_MAX blocks at most.
+ */
+static void fork_prepare(void) {
+  pthread_mutex_lock(&heap_lock);
+  pthread_mutex_lock(&profile_lock);
+  pthread_mutex_lock(&record_lock);
+}
+
+static void fork_parent(void) {
+  pthread_mutex_unlock(&record_lock);
+  pthread_mutex_unlock(&profile_lock);
+  pthread_mutex_unlock(&heap_lock);
+}
+
+static void fork_child(void) {
+  recording = false; /* the trace is the parent's */
+  pthread_mutex_unlock(&record_lock);
+  pthread_mutex_unlock(&profile_lock);
+  pthread_mutex_unlock(&heap_lock);
+  if (maintained) {
+    maintained = false;
+    drain(&maint_stats.overflowed);
+  }
+}
+
+/*
+ * libmm_init - register fork handlers, set the profiler up and start the
+ *    maintenance thread if MM_MAINTAIN gives its CPU budget, in percent of
+ *    one CPU. All may allocate, so this is not done under the heap lock.
+ */
+__attribute__((constructor)) static void libmm_init(void) {
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+  profile_init();
+  record_init();
+
+  const char *budget = getenv("MM_MAINTAIN");
+  if (budget == NULL)
+    return;
+
+  maint_budget = MIN(MAX(atoi(budget), 1), 100);
+
+  pthread_attr_t attr;
+  pthread_t tid;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  maintained = pthread_create(&tid, &attr, maintain, NULL) == 0;
+  pthread_attr_destroy(&attr);
+}
+
+/*
+ * libmm_fini - write the last profile and recorded trace, and report
+ *    what the maintenance thread did, if asked for with MM_MAINTAIN_STATS
+ */
+__attribute__((destructor)) static void libmm_fini(void) {
+  if (profiling)
+    mm_profile_dump(NULL);
+  record_fini();
+
+  if (!maintained || getenv("MM_MAINTAIN_STATS") == NULL)
+    return;
+
+  fprintf(stderr,
+          "libmm: %lu passes, %lu frees deferred, %lu done by free, "
+          "%lu KiB trimmed, %lu KiB prefaulted, %.1f ms CPU\n",
+          maint_stats.passes, maint_stats.deferred, maint_stats.overflowed,
+          maint_stats.trimmed >> 10, maint_stats.prefaulted >> 10,
+          maint_stats.cpu_ns / 1e6);
+}
+
+/*
+ * heap_memalign - memalign with alignment already checked
+ */
+static void *heap_memalign(size_t alignment, size_t size) {
+  if (size > MAX_REQUEST || alignment > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (!heap_enter())
+    return NULL;
+  void *ptr = mm_memalign(alignment, size ? size : 1);
+  heap_leave();
+  if (ptr == NULL)
+    errno = ENOMEM;
+  profile_malloc(ptr, size);
+  record_alloc(ptr, alignment, size ? size : 1);
+  return ptr;
+}
+
+/*
+ * malloc - zero sized requests get a unique pointer, like in glibc
+ */
+EXPORT void *malloc(size_t size) {
+  if (size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (!heap_enter())
+    return NULL;
+  void *ptr = mm_malloc(size ? size : 1);
+  heap_leave();
+  if (ptr == NULL)
+    errno = ENOMEM;
+  profile_malloc(ptr, size);
+  record_alloc(ptr, 0, size ? size : 1);
+  return ptr;
+}
+
+EXPORT void free(void *ptr) {
+  if (ptr == NULL || !in_heap(ptr))
+    return;
+  profile_free(ptr);
+  record_free(ptr);
+  if (maintained) {
+    defer_free(ptr);
+    return;
+  }
+  pthread_mutex_lock(&heap_lock);
+  mm_free(ptr);
+  heap_leave();
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+  size_t bytes;
+
+  if (__builtin_mul_overflow(nmemb, size, &bytes) || bytes > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (!heap_enter())
+    return NULL;
+  void *ptr = mm_calloc(bytes ? bytes : 1, 1);
+  heap_leave();
+  if (ptr == NULL)
+    errno = ENOMEM;
+  profile_malloc(ptr, bytes);
+  record_alloc(ptr, 0, bytes ? bytes : 1);
+  return ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  /* Block of unknown size handed out before this library was loaded */
+  if (!in_heap(ptr)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  /* Block is profiled again as a new one of the new size */
+  profile_free(ptr);
+  pthread_mutex_lock(&heap_lock);
+  void *new_ptr = mm_realloc(ptr, size);
+  record_realloc(ptr, new_ptr, size);
+  heap_leave();
+  if (new_ptr == NULL)
+    errno = ENOMEM;
+  profile_malloc(new_ptr, size);
+  return new_ptr;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+  size_t bytes;
+
+  if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, bytes);
+}
+
+/*
+ * memalign - like glibc, alignment that is not a power of two is rounded
+ *    up to one
+ */
+EXPORT void *memalign(size_t alignment, size_t size) {
+  if (alignment > MAX_REQUEST) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (alignment & (alignment - 1))
+    alignment = (size_t)1 << (64 - __builtin_clzl(alignment));
+  return heap_memalign(alignment ? alignment : 1, size);
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1))) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return heap_memalign(alignment, size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (alignment == 0 || alignment % sizeof(void *) ||
+      (alignment & (alignment - 1)))
+    return EINVAL;
+
+  int saved = errno;
+  void *ptr = heap_memalign(alignment, size);
+  if (ptr == NULL)
+    return errno;
+  errno = saved;
+  *memptr = ptr;
+  return 0;
+}
+
+EXPORT void *valloc(size_t size) {
+  return heap_memalign(getpagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+  size_t page = getpagesize();
+
+  if (size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return heap_memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+/*
+ * malloc_usable_size - the caller owns the block, so its header can be
+ *    read without the lock
+ */
+EXPORT size_t malloc_usable_size(void *ptr) {
+  if (ptr == NULL || !in_heap(ptr))
+    return 0;
+  return mm_usable_size(ptr);
+}
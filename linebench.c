@@ -0,0 +1,147 @@
+/*
+ * linebench.c - Throughput of per-thread counters allocated with mm_malloc
+ *               against counters allocated with mm_malloc_isolated.
+ *
+ * Every thread increments its own counter. Counters from mm_malloc are
+ * packed into 16 byte blocks, so counters of up to four threads share a
+ * cache line and every increment steals the line from the others (false
+ * sharing). Counters from mm_malloc_isolated own whole lines.
+ * The allocator is not thread safe, so counters are allocated up front
+ * by the main thread and the threads only write to them.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+#define MAXTHREADS 64
+
+typedef struct {
+  volatile uint64_t *counter;
+  long iters;
+} worker_t;
+
+static double now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1E-6 * tv.tv_usec;
+}
+
+static void *worker(void *arg) {
+  worker_t *w = arg;
+
+  for (long i = 0; i < w->iters; i++)
+    (*w->counter)++;
+  return NULL;
+}
+
+/*
+ * run - time nthreads threads incrementing their counters iters times
+ */
+static double run(uint64_t **counters, int nthreads, long iters) {
+  pthread_t tids[MAXTHREADS];
+  worker_t workers[MAXTHREADS];
+
+  double start = now();
+  for (int i = 0; i < nthreads; i++) {
+    workers[i].counter = counters[i];
+    workers[i].iters = iters;
+    if (pthread_create(&tids[i], NULL, worker, &workers[i]) != 0) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(tids[i], NULL);
+  double secs = now() - start;
+
+  for (int i = 0; i < nthreads; i++) {
+    if (*counters[i] != (uint64_t)iters) {
+      fprintf(stderr, "counter %d lost increments\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return secs;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: linebench [-h] [-n <iters>] [-t <threads>]\n");
+  fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-h            Print this message.\n");
+  fprintf(stderr, "\t-n <iters>    Increment each counter <iters> times.\n");
+  fprintf(stderr, "\t-t <threads>  Run <threads> threads.\n");
+}
+
+int main(int argc, char **argv) {
+  uint64_t *packed[MAXTHREADS], *isolated[MAXTHREADS];
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  long iters = 100000000;
+  int c;
+
+  while ((c = getopt(argc, argv, "hn:t:")) != EOF) {
+    switch (c) {
+      case 'n':
+        iters = atol(optarg);
+        break;
+
+      case 't':
+        nthreads = atoi(optarg);
+        break;
+
+      case 'h':
+        usage();
+        exit(EXIT_SUCCESS);
+
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (nthreads < 1 || nthreads > MAXTHREADS) {
+    fprintf(stderr, "number of threads must be between 1 and %d\n",
+            MAXTHREADS);
+    exit(EXIT_FAILURE);
+  }
+
+  mem_init();
+  if (mm_init() < 0) {
+    fprintf(stderr, "mm_init failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    packed[i] = mm_malloc(sizeof(uint64_t));
+    isolated[i] = mm_malloc_isolated(sizeof(uint64_t));
+    if (packed[i] == NULL || isolated[i] == NULL) {
+      fprintf(stderr, "counter allocation failed\n");
+      exit(EXIT_FAILURE);
+    }
+    *packed[i] = *isolated[i] = 0;
+  }
+
+  double packed_secs = run(packed, nthreads, iters);
+  double isolated_secs = run(isolated, nthreads, iters);
+  double ops = (double)nthreads * iters / 1e6;
+
+  printf("%d threads, %ld increments each\n", nthreads, iters);
+  printf("mm_malloc:          %10.0f Mops/s\n", ops / packed_secs);
+  printf("mm_malloc_isolated: %10.0f Mops/s (%.2fx)\n", ops / isolated_secs,
+         packed_secs / isolated_secs);
+
+  for (int i = 0; i < nthreads; i++) {
+    mm_free(packed[i]);
+    mm_free_isolated(isolated[i]);
+  }
+  mm_checkheap(0);
+  mem_deinit();
+
+  return EXIT_SUCCESS;
+}
@@ -10,16 +10,23 @@
  * WARNING! This file has been heavily modified compared to the original.
  */
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <float.h>
+#include <limits.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 
 #include "memlib.h"
@@ -36,6 +43,25 @@
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
+/* Returns true if p is a-byte aligned */
+#define IS_ALIGNED_TO(p, a) ((((unsigned long)(p)) % (a)) == 0)
+/* Rounds n up to a multiple of a, which is a power of two */
+#define ALIGN_TO(n, a) (((n) + (a)-1) & ~((size_t)(a)-1))
+#define ALIGN(n) ALIGN_TO(n, ALIGNMENT)
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/* Bytes between payload bytes touched by touch replay, one cache line */
+#define TOUCH_STRIDE 64
+
+/* Heap heatmap drawn by -m, see eval_mm_heatmap */
+#define HEATMAP_COLUMNS 512 /* buckets of addresses in a sample */
+#define HEATMAP_ROWS 256    /* samples taken unless -n says otherwise */
+#define HEATMAP_CELL 2      /* pixels of a bucket and of a sample */
+
+/* Threads of a recorded trace, replayed each on its own thread by -P */
+#define MAXTHREADS 256
 
 /* weights */
 #define WNONE 0
@@ -64,11 +90,22 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-  enum { ALLOC, FREE, REALLOC } type; /* type of request */
-  int index;                          /* index for free() to use later */
-  size_t size;                        /* byte size of alloc/realloc request */
+  enum { ALLOC, FREE, REALLOC, MEMALIGN } type; /* type of request */
+  int index;                                    /* index for free() */
+  size_t size;                                  /* byte size of request */
+  size_t alignment;                             /* alignment for memalign */
+  int thread; /* thread that made the request, 0 if not recorded */
+  long time;  /* ns since recording started, 0 if not recorded */
 } traceop_t;
 
+/* Lifetime of a block, which eval_mm_bound places at offset */
+typedef struct {
+  int start, end;   /* request that allocates and the one that frees it */
+  size_t size;      /* aligned size of block */
+  size_t alignment; /* alignment of block */
+  size_t offset;    /* where the block is placed */
+} lifetime_t;
+
 /* Holds the information for one trace file*/
 typedef struct {
   char filename[MAXLINE];
@@ -76,10 +113,12 @@ typedef struct {
   int num_ids;          /* number of alloc/realloc ids */
   int num_ops;          /* number of distinct requests */
   int weight;           /* weight for this trace (unused) */
+  int num_threads;      /* threads that made the requests, 1 if not recorded */
   traceop_t *ops;       /* array of requests */
   char **blocks;        /* array of ptrs returned by malloc/realloc... */
   size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
   int *block_rand_base; /* index into random_data, if debug is on */
+  uint64_t *block_sums; /* checksum of random data, with DBG_EXPENSIVE */
 } trace_t;
 
 /*
@@ -90,8 +129,41 @@ typedef struct {
 typedef struct {
   trace_t *trace;
   range_t *ranges;
+  int failed; /* set if region replay ran out of heap */
 } speed_t;
 
+/*
+ * Maps block ids of a streamed trace to slots in the trace arrays. A slot
+ * is recycled as soon as its block is freed, so the arrays only need room
+ * for blocks that are live at the same time, not for every id in the trace.
+ */
+typedef struct {
+  int *ids;   /* open addressing table of live ids, -1 if entry is empty */
+  int *slots; /* slot of the id in the same entry */
+  int mask;   /* number of entries - 1 */
+  int count;  /* number of live ids */
+  int *free;  /* stack of slots released by frees */
+  int nfree;  /* number of slots on the stack */
+  int nslots; /* number of slots handed out so far */
+} slotmap_t;
+
+/*
+ * Streamed trace: requests are parsed by a prefetch thread into one of
+ * two buffers while the other one is replayed.
+ */
+typedef struct {
+  FILE *file;
+  trace_t *trace;     /* header fields and slot arrays */
+  long left;          /* requests not parsed yet */
+  int chunk;          /* size of buffers in requests */
+  traceop_t *buf[2];  /* parsed requests */
+  int len[2];         /* requests in buffer, 0 marks end of trace */
+  int full[2];        /* buffer is parsed and not replayed yet */
+  int stop;           /* replay failed, stop parsing */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} stream_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
   /* set in read_trace */
@@ -108,6 +180,31 @@ typedef struct {
   int used;    /* maximum bytes used by allocated blocks */
   int total;   /* total heap size */
 
+  /* defined only if TLB statistics were requested */
+  size_t pagesize;   /* size of pages backing the heap */
+  double tlb_loads;  /* dTLB loads during timed run (< 0 if unknown) */
+  double tlb_misses; /* dTLB load misses during timed run (< 0 if unknown) */
+
+  /* defined only if allocator statistics were requested */
+  mm_stats_t mm; /* allocator counters at the end of the util run */
+
+  /* defined only if region replay was requested */
+  double region_secs; /* secs of region replay (< 0 if out of heap) */
+
+  /* defined only if utilization bounds were requested */
+  long bound_used;    /* peak of live bytes aligned to ALIGNMENT */
+  size_t bound_total; /* heap size used by offline placer */
+
+  /* defined only if touch replay was requested */
+  double touch_secs; /* secs of replay touching payloads */
+
+  /* defined only if parallel replay was requested */
+  int threads;          /* threads replaying the trace */
+  double parallel_secs; /* wall clock secs of parallel replay */
+  long parallel_p50;    /* median ns per request, lock wait included */
+  long parallel_p99;    /* 99th percentile of the same */
+  long parallel_waits;  /* requests that waited for another thread */
+
   /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -115,11 +212,13 @@ typedef struct {
  * For debugging.  If debug-mode is on, then we have each block start
  * at a "random" place (a hash of the index), and copy random data
  * into it.  With DBG_CHEAP, we check that the data survived when we
- * realloc and when we free.  With DBG_EXPENSIVE, we check every block
- * every operation.
+ * realloc and when we free.  With DBG_EXPENSIVE, we also check blocks
+ * next to the ones each operation changes and a sample of the others
+ * against checksums, see check_around.
  * randint_t should be a byte, in case students return unaligned memory.
  *******************/
 #define RANDOM_DATA_LEN (1 << 16)
+#define DBG_SAMPLE 4 /* blocks checked at random per request with -D */
 typedef unsigned char randint_t;
 static const char randint_t_name[] = "byte";
 static randint_t random_data[RANDOM_DATA_LEN];
@@ -132,6 +231,33 @@ static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode = DBG_CHEAP;
 
 static int verbose = 1; /* global flag for verbose output */
 
+static int tlb_stats = 0; /* report page size and dTLB misses (set by -t) */
+
+static int region_mode = 0; /* also replay trace with regions (set by -R) */
+
+static int mm_statistics = 0; /* print allocator statistics (set by -M) */
+
+static char *trace_events = NULL; /* file for traced calls (set by -T) */
+
+/* Also replay touching payloads, reading this percent of live blocks
+   between requests (set by -w, < 0 if off) */
+static double touch_percent = -1;
+static volatile unsigned long touch_sink; /* keeps payload reads alive */
+
+static int bound_mode = 0; /* compute utilization bounds (set by -B) */
+
+static int stream_chunk = 0; /* stream trace in chunks of requests (-s) */
+
+/* Draw heatmap of the heap to this file (set by -m), sampled every this
+   many requests (set by -n, 0 for HEATMAP_ROWS samples) */
+static char *heatmap_file = NULL;
+static long heatmap_every = 0;
+
+/* Also replay with a thread per recorded thread (set by -P), keeping the
+   recorded gaps between requests (set by -G) */
+static int parallel_mode = 0;
+static int parallel_gaps = 0;
+
 /*********************
  * Function prototypes
  *********************/
@@ -144,10 +270,13 @@ static void clear_ranges(range_t **ranges);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
-static void check_index(const trace_t *trace, int opnum, int index);
+static void check_index(const trace_t *trace, long opnum, int index);
 static void randomize_block(trace_t *trace, int index);
+static uint64_t block_sum(const unsigned char *p, size_t size);
 
 /* These functions read, allocate, and free storage for traces */
+static long read_header(FILE *tracefile, trace_t *trace);
+static int read_op(FILE *tracefile, const char *filename, traceop_t *op);
 static trace_t *read_trace(stats_t *stats, const char *filename);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
@@ -160,12 +289,31 @@ static void eval_libc_speed(void *ptr);
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int *used_p, int *total_p);
+static void eval_mm_bound(trace_t *trace, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_touch_speed(void *ptr);
+static void eval_mm_region_speed(void *ptr);
+static void eval_mm_parallel(trace_t *trace, stats_t *stats);
+static void eval_mm_heatmap(trace_t *trace, stats_t *stats);
+static int eval_mm_stream(const char *filename, stats_t *stats);
+
+/* Hardware performance counters for dTLB statistics */
+static void tlb_start(int fds[2]);
+static void tlb_stop(int fds[2], stats_t *stats);
 
 /* Various helper routines */
 static void printresults(stats_t *stats);
+static void printtlb(stats_t *stats);
+static void printregion(stats_t *stats);
+static void printtouch(stats_t *stats);
+static void printparallel(stats_t *stats);
+static void printbound(stats_t *stats);
+static void printmmstats(stats_t *stats);
+static void read_mm_stats(mm_stats_t *mm);
+static void write_trace_events(const char *filename);
 static void usage(void);
-static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
+static void malloc_error(const trace_t *trace, long opnum, const char *fmt,
+                         ...)
   __attribute__((format(printf, 3, 4)));
 static void unix_error(const char *fmt, ...)
   __attribute__((format(printf, 1, 2), noreturn));
@@ -212,11 +360,34 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
     if (verbose > 1)
       printf("efficiency, ");
     mm_stats->util = eval_mm_util(trace, &mm_stats->used, &mm_stats->total);
+    if (bound_mode)
+      eval_mm_bound(trace, mm_stats);
+    if (mm_statistics)
+      read_mm_stats(&mm_stats->mm);
+    if (heatmap_file)
+      eval_mm_heatmap(trace, mm_stats);
     speed_params->trace = trace;
     speed_params->ranges = ranges;
     if (verbose > 1)
       printf("and performance.\n");
+    int fds[2] = {-1, -1};
+    if (tlb_stats)
+      tlb_start(fds);
     mm_stats->secs = fsecs(eval_mm_speed, speed_params);
+    if (tlb_stats)
+      tlb_stop(fds, mm_stats);
+    if (trace_events)
+      write_trace_events(trace_events);
+    if (touch_percent >= 0)
+      mm_stats->touch_secs = fsecs(eval_mm_touch_speed, speed_params);
+    if (region_mode) {
+      speed_params->failed = 0;
+      mm_stats->region_secs = fsecs(eval_mm_region_speed, speed_params);
+      if (speed_params->failed)
+        mm_stats->region_secs = -1;
+    }
+    if (parallel_mode)
+      eval_mm_parallel(trace, mm_stats);
   }
 
   free_trace(trace);
@@ -225,6 +396,24 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
   mem_deinit();
 }
 
+/* Run the tests on a trace streamed from its file in a single pass */
+static void run_stream_tests(char *tracefile, stats_t *mm_stats) {
+  mem_init();
+
+  int fds[2] = {-1, -1};
+  if (tlb_stats)
+    tlb_start(fds);
+  mm_stats->valid = eval_mm_stream(tracefile, mm_stats);
+  if (tlb_stats)
+    tlb_stop(fds, mm_stats);
+  if (mm_statistics)
+    read_mm_stats(&mm_stats->mm);
+  if (trace_events)
+    write_trace_events(trace_events);
+
+  mem_deinit();
+}
+
 /**************
  * Main routine
  **************/
@@ -243,7 +432,7 @@ int main(int argc, char **argv) {
    * Read and interpret the command line arguments
    */
   char c;
-  while ((c = getopt(argc, argv, "d:f:v:hVlD")) != EOF) {
+  while ((c = getopt(argc, argv, "d:f:v:hVlBDGHm:Mn:PRSs:T:tw:")) != EOF) {
     switch (c) {
       case 'f': /* Use one specific trace file only (relative to curr dir) */
         tracefile = strdup(optarg);
@@ -269,6 +458,69 @@ int main(int argc, char **argv) {
         debug_mode = DBG_EXPENSIVE;
         break;
 
+      case 'B': /* Compare utilization with bounds for a perfect allocator */
+        bound_mode = 1;
+        break;
+
+      case 'G': /* Parallel replay keeps recorded gaps between requests */
+        parallel_gaps = 1;
+        /* fall through */
+      case 'P': /* Also replay with a thread per recorded thread */
+        parallel_mode = 1;
+        break;
+
+      case 'H': /* Back the heap with huge pages */
+        mem_hugepages(1);
+        break;
+
+      case 'm': /* Draw heatmap of the heap over time */
+        heatmap_file = strdup(optarg);
+        break;
+
+      case 'n': /* Requests between samples of the heatmap */
+        heatmap_every = atol(optarg);
+        if (heatmap_every <= 0) {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'M': /* Print allocator statistics */
+        mm_statistics = 1;
+        break;
+
+      case 'S': /* Back the heap with a shared memory file */
+        mem_shared(1);
+        break;
+
+      case 'R': /* Compare with replay that frees through regions */
+        region_mode = 1;
+        break;
+
+      case 's': /* Stream trace in chunks instead of reading it whole */
+        stream_chunk = atoi(optarg);
+        if (stream_chunk <= 0) {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'T': /* Write calls traced in timed run to a file */
+        trace_events = strdup(optarg);
+        break;
+
+      case 't': /* Report page size and dTLB misses */
+        tlb_stats = 1;
+        break;
+
+      case 'w': /* Also time replay that touches payloads */
+        touch_percent = atof(optarg);
+        if (touch_percent < 0) {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+
       case 'h': /* Print this message */
         usage();
         exit(EXIT_SUCCESS);
@@ -284,6 +536,11 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  if (stream_chunk && (run_libc || region_mode || touch_percent >= 0 ||
+                       bound_mode || parallel_mode || heatmap_file))
+    app_error("-s can't be combined with -l, -B, -m, -P, -R or -w, they "
+              "replay a whole trace several times\n");
+
   if (debug_mode != DBG_NONE)
     init_random_data();
 
@@ -320,12 +577,27 @@ int main(int argc, char **argv) {
     printf("\nTesting mm malloc\n");
 
   /* Allocate the mm stats array, with one stats_t struct per tracefile */
-  run_tests(tracefile, &mm_stats, ranges, &speed_params);
+  if (stream_chunk)
+    run_stream_tests(tracefile, &mm_stats);
+  else
+    run_tests(tracefile, &mm_stats, ranges, &speed_params);
 
   /* Display the mm results */
   if (verbose) {
     printf("\nResults for mm malloc:\n");
     printresults(&mm_stats);
+    if (tlb_stats && mm_stats.valid)
+      printtlb(&mm_stats);
+    if (region_mode && mm_stats.valid)
+      printregion(&mm_stats);
+    if (touch_percent >= 0 && mm_stats.valid)
+      printtouch(&mm_stats);
+    if (parallel_mode && mm_stats.valid)
+      printparallel(&mm_stats);
+    if (bound_mode && mm_stats.valid)
+      printbound(&mm_stats);
+    if (mm_statistics && mm_stats.valid)
+      printmmstats(&mm_stats);
   }
 
   return mm_stats.valid ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -446,13 +718,19 @@ static void randomize_block(trace_t *traces, int index) {
 
   randint_t *block = (randint_t *)traces->blocks[index];
   size_t size = traces->block_sizes[index] / sizeof(*block);
-  int base = traces->block_rand_base[index];
+  size_t off = traces->block_rand_base[index] % RANDOM_DATA_LEN;
+
+  /* Copy random data in runs up to where it wraps around */
+  for (size_t i = 0, n; i < size; i += n, off = 0) {
+    n = MIN(size - i, RANDOM_DATA_LEN - off);
+    memcpy(block + i, random_data + off, n * sizeof(*block));
+  }
 
-  for (size_t i = 0; i < size; i++)
-    block[i] = random_data[(base + i) % RANDOM_DATA_LEN];
+  if (debug_mode == DBG_EXPENSIVE)
+    traces->block_sums[index] = block_sum(block, size);
 }
 
-static void check_index(const trace_t *trace, int opnum, int index) {
+static void check_index(const trace_t *trace, long opnum, int index) {
   if (index < 0)
     return; /* we're doing free(NULL) */
   if (debug_mode == DBG_NONE)
@@ -461,10 +739,20 @@ static void check_index(const trace_t *trace, int opnum, int index) {
   randint_t *block = (randint_t *)trace->blocks[index];
   size_t size = trace->block_sizes[index] / sizeof(*block);
   int base = trace->block_rand_base[index];
+  size_t off = base % RANDOM_DATA_LEN;
+  size_t i, n;
   int ngarbled = 0;
   int firstgarbled = -1;
 
-  for (size_t i = 0; i < size; i++) {
+  /* Compare runs up to where random data wraps around, and only count
+     garbled bytes from the first run that differs */
+  for (i = 0; i < size; i += n, off = 0) {
+    n = MIN(size - i, RANDOM_DATA_LEN - off);
+    if (memcmp(block + i, random_data + off, n * sizeof(*block)) != 0)
+      break;
+  }
+
+  for (; i < size; i++) {
     if (block[i] != random_data[(base + i) % RANDOM_DATA_LEN]) {
       if (firstgarbled == -1)
         firstgarbled = i;
@@ -480,10 +768,250 @@ static void check_index(const trace_t *trace, int opnum, int index) {
   }
 }
 
+/*
+ * block_sum - checksum of size bytes at p, in the style of Fletcher's
+ *    over 8 byte words, so bytes that are swapped or moved change it too
+ */
+static uint64_t block_sum(const unsigned char *p, size_t size) {
+  uint64_t a = size, b = 0, w;
+  size_t i;
+
+  for (i = 0; i + sizeof(w) <= size; i += sizeof(w)) {
+    memcpy(&w, p + i, sizeof(w));
+    a += w;
+    b += a;
+  }
+  w = 0;
+  memcpy(&w, p + i, size - i);
+  a += w;
+  b += a;
+  return a ^ (b * 0x9e3779b97f4a7c15UL);
+}
+
+/*
+ * check_sum - check block against the checksum taken when its random
+ *    data was written, and find the garbled bytes only if it differs
+ */
+static void check_sum(const trace_t *trace, long opnum, int index) {
+  const unsigned char *block = (unsigned char *)trace->blocks[index];
+
+  if (block_sum(block, trace->block_sizes[index]) != trace->block_sums[index])
+    check_index(trace, opnum, index);
+}
+
+/*
+ * Checking every live block before every request, as -D used to, takes
+ * time proportional to requests times live bytes. Instead the blocks
+ * right before and after each block that a request allocates, frees or
+ * moves are checked, since those are the payloads a bad split, coalesce
+ * or realloc writes over, along with DBG_SAMPLE live blocks picked at
+ * random, and all of them at the end of the trace. Live blocks are kept
+ * by address in a bitmap with a bit for every ALIGNMENT bytes of heap
+ * where a payload starts, and in a dense array to pick from.
+ */
+typedef struct {
+  uint64_t *starts; /* bit set where a payload starts */
+  int *owner;       /* index of the block whose payload starts there */
+  int *live;        /* indices of live blocks */
+  int *live_pos;    /* position of each index in live, -1 if not live */
+  int nlive;        /* number of live blocks */
+  unsigned rand_state;
+} blockmap_t;
+
+#define MAP_WORDS (MAX_HEAP / ALIGNMENT / 64)
+
+static blockmap_t *blockmap_new(const trace_t *trace) {
+  blockmap_t *map;
+
+  if (!(map = calloc(1, sizeof(blockmap_t))) ||
+      !(map->starts = calloc(MAP_WORDS, sizeof(uint64_t))) ||
+      !(map->owner = malloc(MAP_WORDS * 64 * sizeof(int))) ||
+      !(map->live = malloc(trace->num_ids * sizeof(int))) ||
+      !(map->live_pos = malloc(trace->num_ids * sizeof(int))))
+    unix_error("malloc failed in blockmap_new");
+  memset(map->live_pos, -1, trace->num_ids * sizeof(int));
+  map->rand_state = 1;
+  return map;
+}
+
+static void blockmap_free(blockmap_t *map) {
+  free(map->starts);
+  free(map->owner);
+  free(map->live);
+  free(map->live_pos);
+  free(map);
+}
+
+/* Position in the bitmap of the ALIGNMENT bytes at p */
+static size_t blockmap_grain(const char *p) {
+  return (p - (char *)mem_heap_lo()) / ALIGNMENT;
+}
+
+static void blockmap_add(blockmap_t *map, const trace_t *trace, int index) {
+  size_t g = blockmap_grain(trace->blocks[index]);
+
+  map->starts[g / 64] |= 1UL << (g % 64);
+  map->owner[g] = index;
+  map->live_pos[index] = map->nlive;
+  map->live[map->nlive++] = index;
+}
+
+static void blockmap_remove(blockmap_t *map, char *p) {
+  size_t g = blockmap_grain(p);
+  int index = map->owner[g];
+  int last = map->live[--map->nlive];
+
+  map->starts[g / 64] &= ~(1UL << (g % 64));
+  map->live[map->live_pos[index]] = last;
+  map->live_pos[last] = map->live_pos[index];
+  map->live_pos[index] = -1;
+}
+
+/*
+ * blockmap_before, blockmap_after - index of the live block whose payload
+ *    starts last before grain g, or first at or after it; -1 if none
+ */
+static int blockmap_before(const blockmap_t *map, size_t g) {
+  size_t w = g / 64;
+  uint64_t bits = map->starts[w] & ((1UL << (g % 64)) - 1);
+
+  while (bits == 0) {
+    if (w == 0)
+      return -1;
+    bits = map->starts[--w];
+  }
+  return map->owner[w * 64 + 63 - __builtin_clzl(bits)];
+}
+
+static int blockmap_after(const blockmap_t *map, size_t g) {
+  size_t w = g / 64, end = blockmap_grain(mem_heap_hi()) / 64;
+  uint64_t bits;
+
+  if (w > end)
+    return -1;
+  bits = map->starts[w] & (~0UL << (g % 64));
+  while (bits == 0) {
+    if (++w > end)
+      return -1;
+    bits = map->starts[w];
+  }
+  return map->owner[w * 64 + __builtin_ctzl(bits)];
+}
+
+/*
+ * check_around - check the live blocks on both sides of size bytes at p,
+ *    which request opnum changed
+ */
+static void check_around(const trace_t *trace, const blockmap_t *map,
+                         long opnum, char *p, size_t size) {
+  int before = blockmap_before(map, blockmap_grain(p));
+  int after = blockmap_after(map, blockmap_grain(p + ALIGN(MAX(size, 1))));
+
+  if (before >= 0)
+    check_sum(trace, opnum, before);
+  if (after >= 0)
+    check_sum(trace, opnum, after);
+}
+
+/*
+ * check_sample - check DBG_SAMPLE live blocks picked at random
+ */
+static void check_sample(const trace_t *trace, blockmap_t *map, long opnum) {
+  for (int k = 0; k < DBG_SAMPLE && map->nlive > 0; k++) {
+    map->rand_state = map->rand_state * 1103515245 + 12345;
+    check_sum(trace, opnum, map->live[(map->rand_state >> 8) % map->nlive]);
+  }
+}
+
 /**********************************************
  * The following routines manipulate tracefiles
  *********************************************/
 
+/*
+ * read_header - read and check the trace file header, return the number
+ *    of requests in the trace
+ */
+static long read_header(FILE *tracefile, trace_t *trace) {
+  long num_ops = 0;
+  int ignore = 0;
+
+  ignore += fscanf(tracefile, "%d", &trace->weight);
+  ignore += fscanf(tracefile, "%d", &trace->num_ids);
+  ignore += fscanf(tracefile, "%ld", &num_ops);
+  ignore += fscanf(tracefile, "%d", &trace->ignore_ranges);
+
+  if (trace->weight < 0 || trace->weight > 3)
+    app_error("%s: weight can only be in {0, 1, 2, 3}", trace->filename);
+  if (trace->ignore_ranges != 0 && trace->ignore_ranges != 1)
+    app_error("%s: ignore-ranges can only be zero or one", trace->filename);
+
+  return num_ops;
+}
+
+/*
+ * read_op - read the next request line of a trace file, return 0 at
+ *    the end of the file
+ */
+static int read_op(FILE *tracefile, const char *filename, traceop_t *op) {
+  char type[MAXLINE];
+  int index = 0;
+  int size = 0;
+  int alignment = 0;
+  int ignore = 0;
+
+  if (fscanf(tracefile, "%s", type) == EOF)
+    return 0;
+
+  /* Recorded traces start requests with thread number and time in ns */
+  op->thread = 0;
+  op->time = 0;
+  if (isdigit((unsigned char)type[0])) {
+    op->thread = atoi(type);
+    if (fscanf(tracefile, "%ld %s", &op->time, type) != 2)
+      app_error("%s: request of thread %d has no type\n", filename,
+                op->thread);
+  }
+
+  switch (type[0]) {
+    case 'a':
+      ignore += fscanf(tracefile, "%u %u", &index, &size);
+      op->type = ALLOC;
+      op->index = index;
+      op->size = size;
+      break;
+
+    case 'r':
+      ignore += fscanf(tracefile, "%u %u", &index, &size);
+      op->type = REALLOC;
+      op->index = index;
+      op->size = size;
+      break;
+
+    case 'm':
+      ignore += fscanf(tracefile, "%u %u %u", &index, &alignment, &size);
+      if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        app_error("%s: alignment %u is not a power of two", filename,
+                  alignment);
+      op->type = MEMALIGN;
+      op->index = index;
+      op->size = size;
+      op->alignment = alignment;
+      break;
+
+    case 'f':
+      ignore += fscanf(tracefile, "%ud", &index);
+      op->type = FREE;
+      op->index = index;
+      break;
+
+    default:
+      app_error("Bogus type character (%c) in tracefile %s\n", type[0],
+                filename);
+  }
+
+  return 1;
+}
+
 /*
  * read_trace - read a trace file and store it in memory
  */
@@ -503,16 +1031,11 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   if (!(tracefile = fopen(trace->filename, "r")))
     unix_error("Could not open %s in read_trace", trace->filename);
 
-  int ignore = 0;
-  ignore += fscanf(tracefile, "%d", &trace->weight);
-  ignore += fscanf(tracefile, "%d", &trace->num_ids);
-  ignore += fscanf(tracefile, "%d", &trace->num_ops);
-  ignore += fscanf(tracefile, "%d", &trace->ignore_ranges);
-
-  if (trace->weight < 0 || trace->weight > 3)
-    app_error("%s: weight can only be in {0, 1, 2, 3}", trace->filename);
-  if (trace->ignore_ranges != 0 && trace->ignore_ranges != 1)
-    app_error("%s: ignore-ranges can only be zero or one", trace->filename);
+  long num_ops = read_header(tracefile, trace);
+  if (num_ops > INT_MAX)
+    app_error("%s: %ld requests don't fit in memory, stream it with -s",
+              trace->filename, num_ops);
+  trace->num_ops = num_ops;
 
   /* We'll store each request line in the trace in this array */
   if (!(trace->ops = (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))))
@@ -531,44 +1054,24 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
           calloc(trace->num_ids, sizeof(*trace->block_rand_base))))
     unix_error("malloc 5 failed in read_trace");
 
+  /* ... and a checksum of the random data in the block */
+  if (!(trace->block_sums = calloc(trace->num_ids, sizeof(uint64_t))))
+    unix_error("malloc 6 failed in read_trace");
+
   /* read every request line in the trace file */
-  int index = 0;
   int op_index = 0;
   int max_index = 0;
-  char type[MAXLINE];
-  int size;
-
-  while (fscanf(tracefile, "%s", type) != EOF) {
-    switch (type[0]) {
-      case 'a':
-        ignore += fscanf(tracefile, "%u %u", &index, &size);
-        trace->ops[op_index].type = ALLOC;
-        trace->ops[op_index].index = index;
-        trace->ops[op_index].size = size;
-        max_index = (index > max_index) ? index : max_index;
-        break;
-
-      case 'r':
-        ignore += fscanf(tracefile, "%u %u", &index, &size);
-        trace->ops[op_index].type = REALLOC;
-        trace->ops[op_index].index = index;
-        trace->ops[op_index].size = size;
-        max_index = (index > max_index) ? index : max_index;
-        break;
-
-      case 'f':
-        ignore += fscanf(tracefile, "%ud", &index);
-        trace->ops[op_index].type = FREE;
-        trace->ops[op_index].index = index;
-        break;
 
-      default:
-        app_error("Bogus type character (%c) in tracefile %s\n", type[0],
-                  trace->filename);
-    }
+  trace->num_threads = 1;
+  while (op_index < trace->num_ops &&
+         read_op(tracefile, trace->filename, &trace->ops[op_index])) {
+    int index = trace->ops[op_index].index;
+    int thread = trace->ops[op_index].thread;
+    if (trace->ops[op_index].type != FREE)
+      max_index = (index > max_index) ? index : max_index;
+    if (thread >= trace->num_threads)
+      trace->num_threads = thread + 1;
     op_index++;
-    if (op_index == trace->num_ops)
-      break;
   }
 
   fclose(tracefile);
@@ -601,94 +1104,494 @@ static void free_trace(trace_t *trace) {
   free(trace->blocks);
   free(trace->block_sizes);
   free(trace->block_rand_base);
+  free(trace->block_sums);
   free(trace); /* and the trace record itself... */
 }
 
-/**********************************************************************
- * The following functions evaluate the correctness, space utilization,
- * and throughput of the libc and mm malloc packages.
- **********************************************************************/
+/******************************************************************
+ * The following routines replay traces that are too large to be read
+ * into memory. Requests are parsed in chunks on a prefetch thread and
+ * block ids are mapped to recycled slots, so memory use is bounded by
+ * the chunk size and the number of blocks live at the same time.
+ *****************************************************************/
 
 /*
- * eval_mm_valid - Check the mm malloc package for correctness
+ * slot_hash - home entry of a block id in the slot map
  */
-static int eval_mm_valid(trace_t *trace, range_t **ranges) {
-  /* Reset the heap and free any records in the range list */
-  mem_reset_brk();
-  clear_ranges(ranges);
-  reinit_trace(trace);
+static int slot_hash(const slotmap_t *map, int id) {
+  return ((unsigned)id * 2654435761u) & map->mask;
+}
 
-  /* Call the mm package's init function */
-  if (mm_init() < 0) {
-    malloc_error(trace, 0, "mm_init failed.");
-    return 0;
-  }
+/*
+ * slot_init - make an empty slot map with slot arrays in trace
+ */
+static void slot_init(slotmap_t *map, trace_t *trace) {
+  int entries = 1024;
+
+  map->mask = entries - 1;
+  map->count = map->nfree = map->nslots = 0;
+  trace->num_ids = entries / 2;
+  if (!(map->ids = malloc(entries * sizeof(int))) ||
+      !(map->slots = malloc(entries * sizeof(int))) ||
+      !(map->free = malloc(trace->num_ids * sizeof(int))) ||
+      !(trace->blocks = malloc(trace->num_ids * sizeof(char *))) ||
+      !(trace->block_sizes = malloc(trace->num_ids * sizeof(size_t))) ||
+      !(trace->block_rand_base = malloc(trace->num_ids * sizeof(int))) ||
+      !(trace->block_sums = malloc(trace->num_ids * sizeof(uint64_t))))
+    unix_error("malloc failed in slot_init");
+  memset(map->ids, -1, entries * sizeof(int));
+}
 
-  /* Interpret each operation in the trace in order */
-  for (int i = 0; i < trace->num_ops; i++) {
-    int index = trace->ops[i].index;
-    size_t size = trace->ops[i].size;
-    char *newp;
-    char *oldp;
-    char *p;
+/*
+ * slot_deinit - free the slot map and slot arrays
+ */
+static void slot_deinit(slotmap_t *map, trace_t *trace) {
+  free(map->ids);
+  free(map->slots);
+  free(map->free);
+  free(trace->blocks);
+  free(trace->block_sizes);
+  free(trace->block_rand_base);
+  free(trace->block_sums);
+}
 
-    if (debug_mode == DBG_EXPENSIVE) {
-      /* Let the students check their own heap */
-      mm_checkheap(verbose);
+/*
+ * slot_find - return slot of a live block id or -1
+ */
+static int slot_find(const slotmap_t *map, int id) {
+  for (int i = slot_hash(map, id); map->ids[i] >= 0; i = (i + 1) & map->mask)
+    if (map->ids[i] == id)
+      return map->slots[i];
+  return -1;
+}
 
-      /* Now check that all our allocated blocks have the right data */
-      range_t *r = *ranges;
-      while (r) {
-        check_index(trace, i, r->index);
-        r = r->next;
-      }
-    }
+/*
+ * slot_grow - double the slot map table
+ */
+static void slot_grow(slotmap_t *map) {
+  int *ids = map->ids, *slots = map->slots;
+  int entries = map->mask + 1;
+
+  map->mask = 2 * entries - 1;
+  if (!(map->ids = malloc(2 * entries * sizeof(int))) ||
+      !(map->slots = malloc(2 * entries * sizeof(int))))
+    unix_error("malloc failed in slot_grow");
+  memset(map->ids, -1, 2 * entries * sizeof(int));
+
+  for (int j = 0; j < entries; j++) {
+    if (ids[j] < 0)
+      continue;
+    int i = slot_hash(map, ids[j]);
+    while (map->ids[i] >= 0)
+      i = (i + 1) & map->mask;
+    map->ids[i] = ids[j];
+    map->slots[i] = slots[j];
+  }
 
-    switch (trace->ops[i].type) {
-      case ALLOC: /* mm_malloc */
-        /* Call the student's malloc */
-        if ((p = mm_malloc(size)) == NULL) {
-          malloc_error(trace, i, "mm_malloc failed.");
-          return 0;
-        }
+  free(ids);
+  free(slots);
+}
 
-        /*
-         * Test the range of the new block for correctness and add it
-         * to the range list if OK. The block must be  be aligned properly,
-         * and must not overlap any currently allocated block.
-         */
-        if (add_range(ranges, p, size, trace, i, index) == 0)
-          return 0;
+/*
+ * slot_bind - return slot of a block id, giving it an empty slot if the
+ *    id is not live
+ */
+static int slot_bind(slotmap_t *map, trace_t *trace, int id) {
+  int slot = slot_find(map, id);
+
+  if (slot >= 0)
+    return slot;
+
+  if (map->nfree > 0) {
+    slot = map->free[--map->nfree];
+  } else {
+    /* No freed slot to recycle, so make the slot arrays larger */
+    if (map->nslots == trace->num_ids) {
+      trace->num_ids *= 2;
+      if (!(map->free = realloc(map->free, trace->num_ids * sizeof(int))) ||
+          !(trace->blocks =
+              realloc(trace->blocks, trace->num_ids * sizeof(char *))) ||
+          !(trace->block_sizes =
+              realloc(trace->block_sizes, trace->num_ids * sizeof(size_t))) ||
+          !(trace->block_rand_base =
+              realloc(trace->block_rand_base, trace->num_ids * sizeof(int))) ||
+          !(trace->block_sums =
+              realloc(trace->block_sums, trace->num_ids * sizeof(uint64_t))))
+        unix_error("realloc failed in slot_bind");
+    }
+    slot = map->nslots++;
+  }
 
-        /* Remember region */
-        trace->blocks[index] = p;
-        trace->block_sizes[index] = size;
+  if (2 * (map->count + 1) > map->mask + 1)
+    slot_grow(map);
 
-        /* Set to random data, for debugging. */
-        randomize_block(trace, index);
-        break;
+  int i = slot_hash(map, id);
+  while (map->ids[i] >= 0)
+    i = (i + 1) & map->mask;
+  map->ids[i] = id;
+  map->slots[i] = slot;
+  map->count++;
 
-      case REALLOC: /* mm_realloc */
-        check_index(trace, i, index);
+  trace->blocks[slot] = NULL;
+  trace->block_sizes[slot] = 0;
+  return slot;
+}
 
-        /* Call the student's realloc */
-        oldp = trace->blocks[index];
-        newp = mm_realloc(oldp, size);
-        if ((newp == NULL) && (size != 0)) {
-          malloc_error(trace, i, "mm_realloc failed.");
-          return 0;
-        }
-        if ((newp != NULL) && (size == 0)) {
-          malloc_error(trace, i, "mm_realloc with size 0 returned non-NULL.");
-          return 0;
-        }
+/*
+ * slot_release - recycle the slot of a block id that is no longer live
+ */
+static void slot_release(slotmap_t *map, int id) {
+  int i = slot_hash(map, id);
 
-        /* Remove the old region from the range list */
-        remove_range(ranges, oldp);
+  while (map->ids[i] != id) {
+    if (map->ids[i] < 0)
+      return;
+    i = (i + 1) & map->mask;
+  }
 
-        /* Check new block for correctness and add it to range list */
-        if (size > 0 && add_range(ranges, newp, size, trace, i, index) == 0)
-          return 0;
+  map->free[map->nfree++] = map->slots[i];
+  map->count--;
+
+  /* Move back entries that would not be found past the hole */
+  for (int j = (i + 1) & map->mask; map->ids[j] >= 0; j = (j + 1) & map->mask) {
+    int home = slot_hash(map, map->ids[j]);
+    if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+      map->ids[i] = map->ids[j];
+      map->slots[i] = map->slots[j];
+      i = j;
+    }
+  }
+  map->ids[i] = -1;
+}
+
+/*
+ * stream_prefetch - parse requests into the buffer that is not being
+ *    replayed, until the end of the trace or until replay stops
+ */
+static void *stream_prefetch(void *arg) {
+  stream_t *s = (stream_t *)arg;
+
+  for (int b = 0;; b ^= 1) {
+    pthread_mutex_lock(&s->lock);
+    while (s->full[b])
+      pthread_cond_wait(&s->cond, &s->lock);
+    int stop = s->stop;
+    pthread_mutex_unlock(&s->lock);
+
+    int len = 0;
+    while (!stop && len < s->chunk && s->left > 0 &&
+           read_op(s->file, s->trace->filename, &s->buf[b][len])) {
+      len++;
+      s->left--;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->len[b] = len;
+    s->full[b] = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    if (len == 0)
+      return NULL;
+  }
+}
+
+/*
+ * stream_replay - replay one request of a streamed trace, return 0 if
+ *    the allocator failed it. Adds the change of requested bytes to used.
+ */
+static int stream_replay(trace_t *trace, slotmap_t *map, const traceop_t *op,
+                         long opnum, long *used) {
+  int slot = -1;
+  char *p = NULL;
+
+  if (debug_mode == DBG_EXPENSIVE)
+    mm_checkheap(verbose);
+
+  switch (op->type) {
+    case ALLOC: /* mm_malloc */
+    case MEMALIGN: /* mm_memalign */
+      if (op->type == ALLOC)
+        p = mm_malloc(op->size);
+      else
+        p = mm_memalign(op->alignment, op->size);
+      if (p == NULL) {
+        malloc_error(trace, opnum, "%s failed.",
+                     op->type == ALLOC ? "mm_malloc" : "mm_memalign");
+        return 0;
+      }
+      if (!IS_ALIGNED_TO(p, op->type == ALLOC ? ALIGNMENT : op->alignment)) {
+        malloc_error(trace, opnum, "Payload address (%p) not aligned", p);
+        return 0;
+      }
+      slot = slot_bind(map, trace, op->index);
+      trace->blocks[slot] = p;
+      trace->block_sizes[slot] = op->size;
+      *used += op->size;
+      randomize_block(trace, slot);
+      break;
+
+    case REALLOC: /* mm_realloc */
+      slot = slot_bind(map, trace, op->index);
+      check_index(trace, opnum, slot);
+      p = mm_realloc(trace->blocks[slot], op->size);
+      if (p == NULL && op->size != 0) {
+        malloc_error(trace, opnum, "mm_realloc failed.");
+        return 0;
+      }
+      if (p != NULL && !IS_ALIGNED(p)) {
+        malloc_error(trace, opnum, "Payload address (%p) not aligned", p);
+        return 0;
+      }
+
+      /* Check up to min(size, oldsize) for correct copying */
+      *used += (long)op->size - (long)trace->block_sizes[slot];
+      trace->blocks[slot] = p;
+      if (op->size < trace->block_sizes[slot])
+        trace->block_sizes[slot] = op->size;
+      check_index(trace, opnum, slot);
+      trace->block_sizes[slot] = op->size;
+      randomize_block(trace, slot);
+
+      /* Zero sized realloc freed the block */
+      if (op->size == 0)
+        slot_release(map, op->index);
+      break;
+
+    case FREE: /* mm_free */
+      if (op->index >= 0 && (slot = slot_find(map, op->index)) >= 0) {
+        check_index(trace, opnum, slot);
+        p = trace->blocks[slot];
+        *used -= trace->block_sizes[slot];
+        slot_release(map, op->index);
+      }
+      mm_free(p);
+      break;
+
+    default:
+      app_error("Nonexistent request type in stream_replay");
+  }
+
+  return 1;
+}
+
+/*
+ * eval_mm_stream - Check, measure utilization and time the mm malloc
+ *    package in one pass over a trace that is streamed from its file.
+ *    The range list is not kept, so overlapping blocks are not detected;
+ *    with -d0 the time is that of the allocator, parsing runs alongside.
+ */
+static int eval_mm_stream(const char *filename, stats_t *stats) {
+  trace_t trace;
+  stream_t s;
+  slotmap_t map;
+  pthread_t prefetcher;
+  long opnum = 0;
+  long used = 0;
+  long max_used = 0;
+  int valid = 1;
+
+  if (verbose > 1)
+    printf("Streaming tracefile: %s\n", filename);
+
+  strcpy(trace.filename, filename);
+  if (!(s.file = fopen(filename, "r")))
+    unix_error("Could not open %s in eval_mm_stream", filename);
+  s.left = read_header(s.file, &trace);
+  s.trace = &trace;
+  s.chunk = stream_chunk;
+  s.len[0] = s.len[1] = 0;
+  s.full[0] = s.full[1] = 0;
+  s.stop = 0;
+  if (!(s.buf[0] = malloc(2 * s.chunk * sizeof(traceop_t))))
+    unix_error("malloc failed in eval_mm_stream");
+  s.buf[1] = s.buf[0] + s.chunk;
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.cond, NULL);
+  slot_init(&map, &trace);
+
+  strcpy(stats->filename, filename);
+  stats->weight = trace.weight;
+
+  mem_reset_brk();
+  if (mm_init() < 0) {
+    malloc_error(&trace, 0, "mm_init failed.");
+    valid = 0;
+  }
+
+  struct timeval stv, etv;
+  gettimeofday(&stv, NULL);
+
+  if (pthread_create(&prefetcher, NULL, stream_prefetch, &s) != 0)
+    app_error("pthread_create failed in eval_mm_stream");
+
+  for (int b = 0;; b ^= 1) {
+    pthread_mutex_lock(&s.lock);
+    while (!s.full[b])
+      pthread_cond_wait(&s.cond, &s.lock);
+    int len = s.len[b];
+    pthread_mutex_unlock(&s.lock);
+
+    if (len == 0)
+      break;
+
+    /* After a failure, buffers are only handed back until parsing stops */
+    for (int i = 0; valid && i < len; i++, opnum++) {
+      valid = stream_replay(&trace, &map, &s.buf[b][i], opnum, &used);
+      max_used = (used > max_used) ? used : max_used;
+    }
+
+    pthread_mutex_lock(&s.lock);
+    s.full[b] = 0;
+    s.stop = !valid;
+    pthread_cond_broadcast(&s.cond);
+    pthread_mutex_unlock(&s.lock);
+  }
+
+  pthread_join(prefetcher, NULL);
+  gettimeofday(&etv, NULL);
+
+  stats->ops = opnum;
+  stats->secs =
+    (etv.tv_sec - stv.tv_sec) + 1E-6 * (etv.tv_usec - stv.tv_usec);
+  stats->used = max_used;
+  stats->total = mem_heapsize();
+  stats->util = (double)max_used / mem_heapsize();
+
+  slot_deinit(&map, &trace);
+  pthread_cond_destroy(&s.cond);
+  pthread_mutex_destroy(&s.lock);
+  free(s.buf[0]);
+  fclose(s.file);
+
+  return valid;
+}
+
+/**********************************************************************
+ * The following functions evaluate the correctness, space utilization,
+ * and throughput of the libc and mm malloc packages.
+ **********************************************************************/
+
+/*
+ * eval_mm_valid - Check the mm malloc package for correctness
+ */
+static int eval_mm_valid(trace_t *trace, range_t **ranges) {
+  blockmap_t *map = NULL; /* live blocks by address, with -D */
+  int valid = 0;
+
+  /* Reset the heap and free any records in the range list */
+  mem_reset_brk();
+  clear_ranges(ranges);
+  reinit_trace(trace);
+
+  /* Call the mm package's init function */
+  if (mm_init() < 0) {
+    malloc_error(trace, 0, "mm_init failed.");
+    return 0;
+  }
+
+  if (debug_mode == DBG_EXPENSIVE)
+    map = blockmap_new(trace);
+
+  /* Interpret each operation in the trace in order */
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    size_t size = trace->ops[i].size;
+    size_t oldsize;
+    char *newp;
+    char *oldp;
+    char *p;
+
+    if (map) {
+      /* Let the students check their own heap */
+      mm_checkheap(verbose);
+
+      /* Now check some of our allocated blocks, see check_around */
+      check_sample(trace, map, i);
+    }
+
+    switch (trace->ops[i].type) {
+      case ALLOC: /* mm_malloc */
+        /* Call the student's malloc */
+        if ((p = mm_malloc(size)) == NULL) {
+          malloc_error(trace, i, "mm_malloc failed.");
+          goto done;
+        }
+
+        /*
+         * Test the range of the new block for correctness and add it
+         * to the range list if OK. The block must be  be aligned properly,
+         * and must not overlap any currently allocated block.
+         */
+        if (add_range(ranges, p, size, trace, i, index) == 0)
+          goto done;
+
+        /* Remember region */
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+
+        /* Set to random data, for debugging. */
+        randomize_block(trace, index);
+        if (map) {
+          blockmap_add(map, trace, index);
+          check_around(trace, map, i, p, size);
+        }
+        break;
+
+      case MEMALIGN: /* mm_memalign */
+        /* Call the student's memalign */
+        if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL) {
+          malloc_error(trace, i, "mm_memalign failed.");
+          goto done;
+        }
+
+        /* Payload must honour the requested alignment */
+        if (!IS_ALIGNED_TO(p, trace->ops[i].alignment)) {
+          malloc_error(trace, i,
+                       "Payload address (%p) not aligned to %zu bytes", p,
+                       trace->ops[i].alignment);
+          goto done;
+        }
+
+        if (add_range(ranges, p, size, trace, i, index) == 0)
+          goto done;
+
+        /* Remember region */
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+
+        /* Set to random data, for debugging. */
+        randomize_block(trace, index);
+        if (map) {
+          blockmap_add(map, trace, index);
+          check_around(trace, map, i, p, size);
+        }
+        break;
+
+      case REALLOC: /* mm_realloc */
+        check_index(trace, i, index);
+
+        /* Call the student's realloc */
+        oldp = trace->blocks[index];
+        oldsize = trace->block_sizes[index];
+        newp = mm_realloc(oldp, size);
+        if ((newp == NULL) && (size != 0)) {
+          malloc_error(trace, i, "mm_realloc failed.");
+          goto done;
+        }
+        if ((newp != NULL) && (size == 0)) {
+          malloc_error(trace, i, "mm_realloc with size 0 returned non-NULL.");
+          goto done;
+        }
+
+        /* Remove the old region from the range list */
+        remove_range(ranges, oldp);
+        if (map && oldp != NULL)
+          blockmap_remove(map, oldp);
+
+        /* Check new block for correctness and add it to range list */
+        if (size > 0 && add_range(ranges, newp, size, trace, i, index) == 0)
+          goto done;
 
         /* Move the region from where it was.
          * Check up to min(size, oldsize) for correct copying. */
@@ -700,6 +1603,14 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
 
         /* Set to random data, for debugging. */
         randomize_block(trace, index);
+        if (map) {
+          if (newp != NULL)
+            blockmap_add(map, trace, index);
+          if (oldp != NULL)
+            check_around(trace, map, i, oldp, oldsize);
+          if (newp != NULL && newp != oldp)
+            check_around(trace, map, i, newp, size);
+        }
         break;
 
       case FREE: /* mm_free */
@@ -711,8 +1622,12 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
         } else {
           p = trace->blocks[index];
           remove_range(ranges, p);
+          if (map)
+            blockmap_remove(map, p);
         }
         mm_free(p);
+        if (map && p != NULL)
+          check_around(trace, map, i, p, trace->block_sizes[index]);
         break;
 
       default:
@@ -720,8 +1635,17 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
     }
   }
 
+  /* Check all blocks left at the end */
+  for (int k = 0; map && k < map->nlive; k++)
+    check_sum(trace, trace->num_ops, map->live[k]);
+
   /* As far as we know, this is a valid malloc package */
-  return 1;
+  valid = 1;
+
+done:
+  if (map)
+    blockmap_free(map);
+  return valid;
 }
 
 /*
@@ -766,6 +1690,20 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
         total_size += size;
         break;
 
+      case MEMALIGN: /* mm_memalign */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
+        if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL)
+          app_error("trace: mm_memalign failed in eval_mm_util");
+
+        /* Remember region and size */
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+
+        total_size += size;
+        break;
+
       case REALLOC: /* mm_realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
@@ -812,6 +1750,116 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
   return ((double)max_total_size / (double)mem_heapsize());
 }
 
+/*
+ * lifetime_cmp - order lifetimes by placement order of eval_mm_bound:
+ *    larger blocks first, and longer living first among equal sizes
+ */
+static int lifetime_cmp(const void *a, const void *b) {
+  const lifetime_t *x = a, *y = b;
+
+  if (x->size != y->size)
+    return x->size < y->size ? 1 : -1;
+  return (y->end - y->start) - (x->end - x->start);
+}
+
+/*
+ * extent_cmp - order extents of placed blocks by address
+ */
+static int extent_cmp(const void *a, const void *b) {
+  const lifetime_t *x = *(lifetime_t *const *)a, *y = *(lifetime_t *const *)b;
+
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * eval_mm_bound - Find how much space a perfect allocator would need.
+ *   Each block lives from the request that allocates it until the one
+ *   that frees it; realloc ends a block and starts a new one. Any
+ *   allocator that aligns payloads to ALIGNMENT needs at least the peak
+ *   of aligned live bytes. An offline placer that knows all lifetimes
+ *   puts blocks, largest first, at the lowest offset that is free for
+ *   their whole life; its heap size is the best utilization known to be
+ *   reachable. Neither counts headers or other metadata.
+ */
+static void eval_mm_bound(trace_t *trace, stats_t *stats) {
+  lifetime_t *blocks, **placed;
+  long *delta;
+  int *open; /* lifetime of each live block index, or -1 */
+  int n = 0;
+
+  if (!(blocks = malloc(trace->num_ops * sizeof(lifetime_t))) ||
+      !(placed = malloc(trace->num_ops * sizeof(lifetime_t *))) ||
+      !(delta = calloc(trace->num_ops + 1, sizeof(long))) ||
+      !(open = malloc(trace->num_ids * sizeof(int))))
+    unix_error("malloc failed in eval_mm_bound");
+  memset(open, -1, trace->num_ids * sizeof(int));
+
+  /* Cut the trace into lifetimes of blocks */
+  for (int i = 0; i < trace->num_ops; i++) {
+    traceop_t *op = &trace->ops[i];
+
+    if (op->index < 0)
+      continue;
+    if (op->type == FREE || op->type == REALLOC) {
+      if (open[op->index] >= 0)
+        blocks[open[op->index]].end = i;
+      open[op->index] = -1;
+    }
+    if (op->type != FREE && op->size > 0) {
+      blocks[n].start = i;
+      blocks[n].end = trace->num_ops;
+      blocks[n].size = ALIGN(op->size);
+      blocks[n].alignment = op->type == MEMALIGN ? op->alignment : ALIGNMENT;
+      if (blocks[n].alignment < ALIGNMENT)
+        blocks[n].alignment = ALIGNMENT;
+      open[op->index] = n++;
+    }
+  }
+
+  /* Peak of aligned live bytes */
+  for (int i = 0; i < n; i++) {
+    delta[blocks[i].start] += blocks[i].size;
+    delta[blocks[i].end] -= blocks[i].size;
+  }
+  long live = 0, peak = 0;
+  for (int i = 0; i < trace->num_ops; i++) {
+    live += delta[i];
+    peak = (live > peak) ? live : peak;
+  }
+  stats->bound_used = peak;
+
+  /* Place blocks knowing their lifetimes */
+  size_t heap = 0;
+  qsort(blocks, n, sizeof(lifetime_t), lifetime_cmp);
+  for (int i = 0; i < n; i++) {
+    lifetime_t *b = &blocks[i];
+    int k = 0;
+
+    for (int j = 0; j < i; j++)
+      if (blocks[j].start < b->end && b->start < blocks[j].end)
+        placed[k++] = &blocks[j];
+    qsort(placed, k, sizeof(lifetime_t *), extent_cmp);
+
+    /* Lowest gap between blocks living at the same time */
+    size_t offset = 0;
+    for (int j = 0; j < k; j++) {
+      if (ALIGN_TO(offset, b->alignment) + b->size <= placed[j]->offset)
+        break;
+      if (placed[j]->offset + placed[j]->size > offset)
+        offset = placed[j]->offset + placed[j]->size;
+    }
+    b->offset = ALIGN_TO(offset, b->alignment);
+    if (b->offset + b->size > heap)
+      heap = b->offset + b->size;
+  }
+  stats->bound_total = heap;
+
+  free(blocks);
+  free(placed);
+  free(delta);
+  free(open);
+}
+
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
@@ -839,6 +1887,14 @@ static void eval_mm_speed(void *ptr) {
         trace->blocks[index] = p;
         break;
 
+      case MEMALIGN: /* mm_memalign */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL)
+          app_error("mm_memalign error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
       case REALLOC: /* mm_realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
@@ -864,6 +1920,596 @@ static void eval_mm_speed(void *ptr) {
   }
 }
 
+/*
+ * touch_write, touch_read - store to and load from every cache line of
+ *    a payload, like a program that fills a block and later uses it
+ */
+static void touch_write(char *p, size_t size) {
+  for (size_t i = 0; i < size; i += TOUCH_STRIDE)
+    p[i] = (char)i;
+}
+
+static void touch_read(const char *p, size_t size) {
+  unsigned long sum = 0;
+
+  for (size_t i = 0; i < size; i += TOUCH_STRIDE)
+    sum += p[i];
+  touch_sink += sum;
+}
+
+/*
+ * eval_mm_touch_speed - Replay the trace like eval_mm_speed, but write
+ *    every payload after it is allocated, read every block before it is
+ *    freed and, between requests, read touch_percent percent of the live
+ *    blocks picked at random. The time then includes the cache misses
+ *    that the block layout causes in the program.
+ */
+static void eval_mm_touch_speed(void *ptr) {
+  trace_t *trace = ((speed_t *)ptr)->trace;
+  int *live, *live_pos; /* live block indices and their positions */
+  int nlive = 0;
+  double credit = 0;
+  unsigned rand_state = 1;
+
+  reinit_trace(trace);
+  if (!(live = malloc(trace->num_ids * sizeof(int))) ||
+      !(live_pos = malloc(trace->num_ids * sizeof(int))))
+    unix_error("malloc failed in eval_mm_touch_speed");
+  memset(live_pos, -1, trace->num_ids * sizeof(int));
+
+  /* Reset the heap and initialize the mm package */
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_touch_speed");
+
+  /* Interpret each trace request */
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    size_t size = trace->ops[i].size;
+    char *p = NULL;
+
+    /* Read some of the live blocks, as the program works on them */
+    for (credit += nlive * touch_percent / 100; credit >= 1; credit--) {
+      rand_state = rand_state * 1103515245 + 12345;
+      int j = live[(rand_state >> 8) % nlive];
+      touch_read(trace->blocks[j], trace->block_sizes[j]);
+    }
+
+    switch (trace->ops[i].type) {
+      case ALLOC: /* mm_malloc */
+        if ((p = mm_malloc(size)) == NULL)
+          app_error("mm_malloc error in eval_mm_touch_speed");
+        touch_write(p, size);
+        break;
+
+      case MEMALIGN: /* mm_memalign */
+        if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL)
+          app_error("mm_memalign error in eval_mm_touch_speed");
+        touch_write(p, size);
+        break;
+
+      case REALLOC: /* mm_realloc */
+        if ((p = mm_realloc(trace->blocks[index], size)) == NULL && size != 0)
+          app_error("mm_realloc error in eval_mm_touch_speed");
+        touch_write(p, size);
+        break;
+
+      case FREE: /* mm_free */
+        if (index < 0) {
+          mm_free(NULL);
+          continue;
+        }
+        touch_read(trace->blocks[index], trace->block_sizes[index]);
+        mm_free(trace->blocks[index]);
+        break;
+
+      default:
+        app_error("Nonexistent request type in eval_mm_touch_speed");
+    }
+
+    trace->blocks[index] = p;
+    trace->block_sizes[index] = size;
+
+    /* Keep the set of live blocks in sync */
+    if (p != NULL && live_pos[index] < 0) {
+      live_pos[index] = nlive;
+      live[nlive++] = index;
+    } else if (p == NULL && live_pos[index] >= 0) {
+      int last = live[--nlive];
+      live[live_pos[index]] = last;
+      live_pos[last] = live_pos[index];
+      live_pos[index] = -1;
+      if (credit > nlive)
+        credit = nlive;
+    }
+  }
+
+  free(live);
+  free(live_pos);
+}
+
+/*
+ * eval_mm_region_speed - Replay the trace as if blocks were allocated
+ *    in requests whose memory dies together. A request lasts until no
+ *    block allocated in it is live; its blocks come from one region and
+ *    frees are dropped until the region is destroyed at the end of it.
+ *    Reallocs copy into a new region block. Sets failed if heap runs out.
+ */
+static void eval_mm_region_speed(void *ptr) {
+  speed_t *params = (speed_t *)ptr;
+  trace_t *trace = params->trace;
+  mm_region_t *region = NULL;
+  int live = 0;
+
+  reinit_trace(trace);
+
+  /* Reset the heap and initialize the mm package */
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_region_speed");
+
+  /* Interpret each trace request */
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    size_t size = trace->ops[i].size;
+    size_t alignment = trace->ops[i].alignment;
+    char *p, *oldp;
+
+    if (trace->ops[i].type == FREE) {
+      if (index < 0)
+        continue;
+      if (--live == 0) {
+        mm_region_destroy(region);
+        region = NULL;
+      }
+      continue;
+    }
+
+    if (region == NULL && (region = mm_region_create()) == NULL)
+      goto failed;
+
+    switch (trace->ops[i].type) {
+      case ALLOC: /* mm_region_alloc */
+        if ((p = mm_region_alloc(region, size)) == NULL)
+          goto failed;
+        live++;
+        break;
+
+      case MEMALIGN: /* mm_region_alloc with room for alignment */
+        if ((p = mm_region_alloc(region, size + alignment)) == NULL)
+          goto failed;
+        p += alignment - (unsigned long)p % alignment;
+        live++;
+        break;
+
+      case REALLOC: /* mm_region_alloc and copy */
+        oldp = trace->blocks[index];
+        p = NULL;
+        if (size > 0 && (p = mm_region_alloc(region, size)) == NULL)
+          goto failed;
+        if (oldp && p)
+          memcpy(p, oldp,
+                 size < trace->block_sizes[index] ? size
+                                                  : trace->block_sizes[index]);
+        live += (oldp == NULL) - (size == 0);
+        break;
+
+      default:
+        app_error("Nonexistent request type in eval_mm_region_speed");
+    }
+
+    trace->blocks[index] = p;
+    trace->block_sizes[index] = size;
+
+    /* A zero sized realloc may have ended the request */
+    if (live == 0) {
+      mm_region_destroy(region);
+      region = NULL;
+    }
+  }
+
+  if (region)
+    mm_region_destroy(region);
+  return;
+
+failed:
+  params->failed = 1;
+}
+
+/*
+ * Heatmap of the heap: every heatmap_every requests the heap is split
+ * into HEATMAP_COLUMNS buckets of addresses, and the bytes of each bucket
+ * are counted as payload of live blocks, free blocks (found by walking
+ * the boundary tags) or the rest, which is headers, padding and the
+ * bytes a block has beyond its request.
+ */
+typedef struct {
+  size_t bucket;                /* bytes of heap in a column */
+  size_t heap_size;             /* heap size at the sample */
+  long payload[HEATMAP_COLUMNS]; /* requested bytes of live blocks */
+  long free[HEATMAP_COLUMNS];    /* bytes of free blocks */
+} heatrow_t;
+
+/*
+ * heat_add - count len bytes from offset off of the heap into buckets
+ */
+static void heat_add(long *buckets, size_t bucket, size_t off, size_t len) {
+  while (len > 0) {
+    size_t b = off / bucket;
+    size_t n = MIN(len, (b + 1) * bucket - off);
+    if (b < HEATMAP_COLUMNS)
+      buckets[b] += n;
+    off += n;
+    len -= n;
+  }
+}
+
+static void heat_block(void *arg, void *block, size_t size, int allocated) {
+  heatrow_t *row = arg;
+
+  if (!allocated)
+    heat_add(row->free, row->bucket, (char *)block - (char *)mem_heap_lo(),
+             size);
+}
+
+/*
+ * heat_sample - count bytes of the heap as it is now into row
+ */
+static void heat_sample(trace_t *trace, heatrow_t *row) {
+  row->heap_size = mem_heapsize();
+  mm_heap_walk(heat_block, row);
+  for (int i = 0; i < trace->num_ids; i++)
+    if (trace->blocks[i] != NULL)
+      heat_add(row->payload, row->bucket,
+               trace->blocks[i] - (char *)mem_heap_lo(),
+               trace->block_sizes[i]);
+}
+
+/*
+ * heat_color - blend colors of payload, free and other bytes of a bucket,
+ *    white where the heap did not reach yet. Channels are rounded, so
+ *    neighbours of about the same mix merge into one rectangle.
+ */
+static unsigned heat_color(const heatrow_t *row, int column) {
+  static const int colors[4][3] = {
+    {31, 119, 180}, /* payload */
+    {214, 39, 40},  /* free */
+    {255, 191, 0},  /* headers and padding */
+    {255, 255, 255} /* not heap yet */
+  };
+  size_t lo = column * row->bucket;
+  size_t in_heap = lo >= row->heap_size ? 0 : MIN(row->bucket,
+                                                  row->heap_size - lo);
+  double share[4];
+  unsigned rgb = 0;
+
+  share[0] = (double)row->payload[column] / row->bucket;
+  share[1] = (double)row->free[column] / row->bucket;
+  share[2] = (double)in_heap / row->bucket - share[0] - share[1];
+  share[3] = 1.0 - (double)in_heap / row->bucket;
+  for (int c = 0; c < 3; c++) {
+    double v = 0;
+    for (int k = 0; k < 4; k++)
+      v += share[k] * colors[k][c];
+    rgb = rgb << 8 | (MIN((int)(v + 8) & ~15, 255));
+  }
+  return rgb;
+}
+
+/*
+ * heat_write - write rows as an SVG image, time going down and addresses
+ *    going right, with axes and a legend
+ */
+static void heat_write(const char *filename, const trace_t *trace,
+                       heatrow_t *rows, int nrows, long every) {
+  const int left = 80, top = 40;
+  const int width = HEATMAP_COLUMNS * HEATMAP_CELL;
+  const int height = nrows * HEATMAP_CELL;
+  size_t heap = rows[0].bucket * HEATMAP_COLUMNS;
+  FILE *fp;
+
+  if ((fp = fopen(filename, "w")) == NULL)
+    unix_error("Could not open %s in heat_write", filename);
+
+  fprintf(fp,
+          "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" "
+          "height=\"%d\" font-family=\"sans-serif\" font-size=\"12\">\n",
+          left + width + 20, top + height + 70);
+  fprintf(fp, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+  fprintf(fp, "<text x=\"%d\" y=\"20\">%s: heap by address, a sample every "
+          "%ld requests</text>\n", left, trace->filename, every);
+
+  /* Runs of buckets of the same color are drawn as one rectangle */
+  for (int r = 0; r < nrows; r++) {
+    int start = 0;
+    unsigned color = heat_color(&rows[r], 0);
+    for (int c = 1; c <= HEATMAP_COLUMNS; c++) {
+      unsigned next = c < HEATMAP_COLUMNS ? heat_color(&rows[r], c) : ~0U;
+      if (next == color)
+        continue;
+      fprintf(fp, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" "
+              "fill=\"#%06x\"/>\n", left + start * HEATMAP_CELL,
+              top + r * HEATMAP_CELL, (c - start) * HEATMAP_CELL,
+              HEATMAP_CELL, color);
+      start = c;
+      color = next;
+    }
+  }
+
+  /* Axes: requests down the left side, addresses along the bottom */
+  fprintf(fp, "<text x=\"%d\" y=\"%d\" text-anchor=\"end\">request 0"
+          "</text>\n", left - 6, top + 10);
+  fprintf(fp, "<text x=\"%d\" y=\"%d\" text-anchor=\"end\">%d</text>\n",
+          left - 6, top + height, trace->num_ops);
+  fprintf(fp, "<text x=\"%d\" y=\"%d\">0</text>\n", left, top + height + 16);
+  fprintf(fp, "<text x=\"%d\" y=\"%d\" text-anchor=\"end\">%zu KB</text>\n",
+          left + width, top + height + 16, heap >> 10);
+
+  /* Legend */
+  static const char *names[] = {"payload", "free", "headers and padding"};
+  static const char *fills[] = {"#1f77b4", "#d62728", "#ffbf00"};
+  for (int k = 0; k < 3; k++) {
+    int x = left + k * 160;
+    fprintf(fp, "<rect x=\"%d\" y=\"%d\" width=\"12\" height=\"12\" "
+            "fill=\"%s\"/>\n", x, top + height + 34, fills[k]);
+    fprintf(fp, "<text x=\"%d\" y=\"%d\">%s</text>\n", x + 18,
+            top + height + 45, names[k]);
+  }
+  fprintf(fp, "</svg>\n");
+  fclose(fp);
+}
+
+/*
+ * eval_mm_heatmap - Replay the trace, sample the heap every heatmap_every
+ *    requests and after the last one, and draw the samples into
+ *    heatmap_file. Buckets are sized so the largest heap of the util run
+ *    fills a row.
+ */
+static void eval_mm_heatmap(trace_t *trace, stats_t *stats) {
+  long every = heatmap_every ? heatmap_every
+                             : MAX(trace->num_ops / HEATMAP_ROWS, 1);
+  int nrows = 0, maxrows = trace->num_ops / every + 1;
+  size_t bucket = ALIGN(MAX(stats->total, 1) / HEATMAP_COLUMNS + 1);
+  heatrow_t *rows;
+
+  if (!(rows = calloc(maxrows, sizeof(heatrow_t))))
+    unix_error("calloc failed in eval_mm_heatmap");
+  for (int r = 0; r < maxrows; r++)
+    rows[r].bucket = bucket;
+
+  reinit_trace(trace);
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_heatmap");
+
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    size_t size = trace->ops[i].size;
+    char *p = NULL;
+
+    if (i > 0 && i % every == 0)
+      heat_sample(trace, &rows[nrows++]);
+
+    switch (trace->ops[i].type) {
+      case ALLOC: /* mm_malloc */
+        if ((p = mm_malloc(size)) == NULL)
+          app_error("mm_malloc error in eval_mm_heatmap");
+        break;
+
+      case MEMALIGN: /* mm_memalign */
+        if ((p = mm_memalign(trace->ops[i].alignment, size)) == NULL)
+          app_error("mm_memalign error in eval_mm_heatmap");
+        break;
+
+      case REALLOC: /* mm_realloc */
+        if ((p = mm_realloc(trace->blocks[index], size)) == NULL && size != 0)
+          app_error("mm_realloc error in eval_mm_heatmap");
+        break;
+
+      case FREE: /* mm_free */
+        if (index < 0) {
+          mm_free(NULL);
+          continue;
+        }
+        mm_free(trace->blocks[index]);
+        break;
+
+      default:
+        app_error("Nonexistent request type in eval_mm_heatmap");
+    }
+
+    trace->blocks[index] = p;
+    trace->block_sizes[index] = size;
+  }
+  heat_sample(trace, &rows[nrows++]);
+
+  heat_write(heatmap_file, trace, rows, nrows, every);
+  free(rows);
+}
+
+/*
+ * Parallel replay runs the requests of every recorded thread on a thread
+ * of its own. Requests of one block keep their order in the trace: the
+ * request that is the n-th on its block waits until the n-1 before it
+ * are done, so a block freed by another thread than the one that got it
+ * is never freed early. The mm package is not thread safe and is called
+ * under a lock, as a thread safe wrapper of it would be.
+ */
+typedef struct {
+  trace_t *trace;
+  int *seq;             /* position of request among those of its block */
+  int *done;            /* requests of every block replayed so far */
+  long start;           /* ns when replay started */
+  pthread_mutex_t lock; /* held around calls to the mm package */
+} parallel_t;
+
+/* One replaying thread */
+typedef struct {
+  parallel_t *shared;
+  int *ops;   /* its requests, in trace order */
+  int nops;   /* number of them */
+  long *ns;   /* time each request took */
+  long waits; /* requests that waited for another thread */
+} replayer_t;
+
+static long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+/* Returns true if request i is next on its block */
+static int block_ready(parallel_t *shared, int i) {
+  int index = shared->trace->ops[i].index;
+  return __atomic_load_n(&shared->done[index], __ATOMIC_ACQUIRE) ==
+         shared->seq[i];
+}
+
+static void *parallel_replay(void *arg) {
+  replayer_t *r = arg;
+  parallel_t *shared = r->shared;
+  trace_t *trace = shared->trace;
+
+  for (int k = 0; k < r->nops; k++) {
+    int i = r->ops[k];
+    traceop_t *op = &trace->ops[i];
+    int index = op->index;
+    char *p = NULL;
+
+    /* Sleep until the request is due, as it was in the recording */
+    long due = shared->start + op->time - trace->ops[0].time;
+    if (parallel_gaps && now_ns() < due) {
+      struct timespec ts = {due / 1000000000L, due % 1000000000L};
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+        ;
+    }
+
+    /* Wait for earlier requests of the block made by other threads */
+    if (index >= 0 && !block_ready(shared, i)) {
+      r->waits++;
+      while (!block_ready(shared, i))
+        sched_yield();
+    }
+
+    long start = now_ns();
+    pthread_mutex_lock(&shared->lock);
+    switch (op->type) {
+      case ALLOC: /* mm_malloc */
+        if ((p = mm_malloc(op->size)) == NULL)
+          app_error("mm_malloc error in eval_mm_parallel");
+        break;
+
+      case MEMALIGN: /* mm_memalign */
+        if ((p = mm_memalign(op->alignment, op->size)) == NULL)
+          app_error("mm_memalign error in eval_mm_parallel");
+        break;
+
+      case REALLOC: /* mm_realloc */
+        if ((p = mm_realloc(trace->blocks[index], op->size)) == NULL &&
+            op->size != 0)
+          app_error("mm_realloc error in eval_mm_parallel");
+        break;
+
+      case FREE: /* mm_free */
+        mm_free(index < 0 ? NULL : trace->blocks[index]);
+        break;
+
+      default:
+        app_error("Nonexistent request type in eval_mm_parallel");
+    }
+    pthread_mutex_unlock(&shared->lock);
+    r->ns[k] = now_ns() - start;
+
+    if (index >= 0) {
+      trace->blocks[index] = p;
+      __atomic_store_n(&shared->done[index], shared->seq[i] + 1,
+                       __ATOMIC_RELEASE);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * eval_mm_parallel - Replay the trace with a thread per recorded thread
+ *    and measure wall clock time and time per request, which includes
+ *    waiting for the lock. With -G requests are made no sooner than they
+ *    were recorded, so threads contend as much as in the program. Beyond
+ *    MAXTHREADS recorded threads share replay threads, which keep the
+ *    order of the trace, so none waits for a request queued behind it.
+ */
+static void eval_mm_parallel(trace_t *trace, stats_t *stats) {
+  int nthreads = MIN(trace->num_threads, MAXTHREADS);
+  pthread_t tids[MAXTHREADS];
+  replayer_t replayers[MAXTHREADS] = {};
+  parallel_t shared = {.trace = trace};
+  long *ns;
+
+  reinit_trace(trace);
+  if (!(shared.seq = malloc(trace->num_ops * sizeof(int))) ||
+      !(shared.done = calloc(trace->num_ids, sizeof(int))) ||
+      !(ns = malloc(trace->num_ops * sizeof(long))))
+    unix_error("malloc failed in eval_mm_parallel");
+
+  /* Number requests of every block, and split requests among threads */
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    if (index >= 0)
+      shared.seq[i] = shared.done[index]++;
+    replayers[trace->ops[i].thread % MAXTHREADS].nops++;
+  }
+  memset(shared.done, 0, trace->num_ids * sizeof(int));
+
+  long *next = ns;
+  for (int t = 0; t < nthreads; t++) {
+    replayers[t].shared = &shared;
+    replayers[t].ns = next;
+    if (!(replayers[t].ops = malloc((replayers[t].nops + 1) * sizeof(int))))
+      unix_error("malloc failed in eval_mm_parallel");
+    next += replayers[t].nops;
+    replayers[t].nops = 0;
+  }
+  for (int i = 0; i < trace->num_ops; i++) {
+    replayer_t *r = &replayers[trace->ops[i].thread % MAXTHREADS];
+    r->ops[r->nops++] = i;
+  }
+
+  /* Reset the heap and initialize the mm package */
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_parallel");
+
+  pthread_mutex_init(&shared.lock, NULL);
+  shared.start = now_ns();
+  for (int t = 0; t < nthreads; t++)
+    if (pthread_create(&tids[t], NULL, parallel_replay, &replayers[t]))
+      app_error("pthread_create failed in eval_mm_parallel");
+  for (int t = 0; t < nthreads; t++)
+    pthread_join(tids[t], NULL);
+  stats->parallel_secs = (now_ns() - shared.start) / 1e9;
+  pthread_mutex_destroy(&shared.lock);
+
+  stats->threads = nthreads;
+  stats->parallel_waits = 0;
+  for (int t = 0; t < nthreads; t++) {
+    stats->parallel_waits += replayers[t].waits;
+    free(replayers[t].ops);
+  }
+  qsort(ns, trace->num_ops, sizeof(long), compare_long);
+  stats->parallel_p50 = ns[trace->num_ops / 2];
+  stats->parallel_p99 = ns[trace->num_ops * 99L / 100];
+
+  free(ns);
+  free(shared.seq);
+  free(shared.done);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -886,6 +2532,15 @@ static int eval_libc_valid(trace_t *trace) {
         trace->blocks[trace->ops[i].index] = p;
         break;
 
+      case MEMALIGN: /* aligned_alloc */
+        if ((p = aligned_alloc(trace->ops[i].alignment, trace->ops[i].size)) ==
+            NULL) {
+          malloc_error(trace, i, "libc aligned_alloc failed");
+          unix_error("System message");
+        }
+        trace->blocks[trace->ops[i].index] = p;
+        break;
+
       case REALLOC: /* realloc */
         newsize = trace->ops[i].size;
         oldp = trace->blocks[trace->ops[i].index];
@@ -935,6 +2590,14 @@ static void eval_libc_speed(void *ptr) {
         trace->blocks[index] = p;
         break;
 
+      case MEMALIGN: /* aligned_alloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = aligned_alloc(trace->ops[i].alignment, size)) == NULL)
+          unix_error("aligned_alloc failed in eval_libc_speed");
+        trace->blocks[index] = p;
+        break;
+
       case REALLOC: /* realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
@@ -958,6 +2621,58 @@ static void eval_libc_speed(void *ptr) {
   }
 }
 
+/**********************************************************
+ * The following routines count dTLB loads and misses with
+ * hardware performance counters, if the system provides them.
+ *********************************************************/
+
+static int tlb_open(int result) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (result << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * tlb_start - Open and enable dTLB counters; fds are -1 if unavailable
+ */
+static void tlb_start(int fds[2]) {
+  fds[0] = tlb_open(PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+  fds[1] = tlb_open(PERF_COUNT_HW_CACHE_RESULT_MISS);
+
+  for (int i = 0; i < 2; i++)
+    if (fds[i] >= 0)
+      ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+}
+
+/*
+ * tlb_stop - Disable dTLB counters and store their values in stats
+ */
+static void tlb_stop(int fds[2], stats_t *stats) {
+  double *values[2] = {&stats->tlb_loads, &stats->tlb_misses};
+
+  stats->pagesize = mem_pagesize();
+
+  for (int i = 0; i < 2; i++) {
+    long long count;
+    *values[i] = -1.0;
+    if (fds[i] < 0)
+      continue;
+    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fds[i], &count, sizeof(count)) == sizeof(count))
+      *values[i] = count;
+    close(fds[i]);
+  }
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -1014,6 +2729,117 @@ static void printresults(stats_t *stats) {
   printf(" %s\n", stats->filename);
 }
 
+/*
+ * printregion - prints region replay time next to per-object time
+ */
+static void printregion(stats_t *stats) {
+  if (stats->region_secs < 0) {
+    printf("Region replay: n/a (ran out of heap)\n");
+    return;
+  }
+  printf("Region replay: %.6f secs, %.0f Kops (%.2fx per-object)\n",
+         stats->region_secs, stats->ops / 1e3 / stats->region_secs,
+         stats->secs / stats->region_secs);
+}
+
+/*
+ * printtouch - prints time of replay touching payloads next to plain time
+ */
+static void printtouch(stats_t *stats) {
+  printf("Touch replay (%g%% of live blocks read per request): %.6f secs, "
+         "%.0f Kops (%.2fx plain)\n",
+         touch_percent, stats->touch_secs, stats->ops / 1e3 / stats->touch_secs,
+         stats->touch_secs / stats->secs);
+}
+
+/*
+ * printparallel - prints time of parallel replay next to serial time
+ */
+static void printparallel(stats_t *stats) {
+  printf("Parallel replay (%d thread%s%s): %.6f secs, %.0f Kops (%.2fx "
+         "serial)\n",
+         stats->threads, stats->threads > 1 ? "s" : "",
+         parallel_gaps ? ", recorded gaps" : "",
+         stats->parallel_secs, stats->ops / 1e3 / stats->parallel_secs,
+         stats->parallel_secs / stats->secs);
+  printf("Per request: p50 %ld ns, p99 %ld ns; %ld requests (%.2f%%) waited "
+         "for another thread\n",
+         stats->parallel_p50, stats->parallel_p99, stats->parallel_waits,
+         100.0 * stats->parallel_waits / stats->ops);
+}
+
+/*
+ * printbound - prints how far utilization is from a perfect allocator
+ */
+static void printbound(stats_t *stats) {
+  printf("Bound: %ld aligned live bytes (%.1f%% util), offline placer %zu "
+         "bytes (%.1f%% util), gap %.1f%%\n",
+         stats->bound_used, 100.0 * stats->used / stats->bound_used,
+         stats->bound_total, 100.0 * stats->used / stats->bound_total,
+         100.0 * stats->used / stats->bound_total - 100.0 * stats->util);
+}
+
+/*
+ * write_trace_events - save calls recorded by mm tracepoints during
+ *    the timed run, for tracedump.py
+ */
+static void write_trace_events(const char *filename) {
+  static mm_trace_event_t events[1 << 20];
+  size_t n = mm_trace_read(events, sizeof(events) / sizeof(events[0]));
+  FILE *fp;
+
+  if (n == 0)
+    fprintf(stderr, "WARNING: no traced calls, mm.c needs -DTRACEPOINTS\n");
+  if ((fp = fopen(filename, "w")) == NULL)
+    unix_error("Could not open %s in write_trace_events", filename);
+  if (fwrite(events, sizeof(events[0]), n, fp) != n)
+    unix_error("Could not write %s in write_trace_events", filename);
+  fclose(fp);
+}
+
+/*
+ * read_mm_stats - take a snapshot of allocator statistics, for callers
+ *    whose mm_stats variable hides the function
+ */
+static void read_mm_stats(mm_stats_t *mm) {
+  mm_stats(mm);
+}
+
+/*
+ * printmmstats - prints allocator statistics taken at the end of util run
+ */
+static void printmmstats(stats_t *stats) {
+  mm_stats_t *mm = &stats->mm;
+
+  printf("Heap: %zu bytes, %zu allocated, %zu free in %zu blocks, "
+         "%zu extensions\n",
+         mm->heap_size, mm->allocated_bytes, mm->free_bytes, mm->free_blocks,
+         mm->extensions);
+  printf("Calls: %zu mallocs, %zu frees, %zu reallocs in place, %zu copied\n",
+         mm->mallocs, mm->frees, mm->reallocs_in_place, mm->reallocs_copied);
+  printf("%10s %10s %10s\n", "class", "mallocs", "free");
+  for (int i = 0; i < MM_STATS_CLASSES; i++)
+    if (mm->malloc_hist[i] || mm->free_hist[i])
+      printf("%9zu+ %10zu %10zu\n", (size_t)ALIGNMENT << i,
+             mm->malloc_hist[i], mm->free_hist[i]);
+}
+
+/*
+ * printtlb - prints page size and dTLB statistics of the timed run
+ */
+static void printtlb(stats_t *stats) {
+  printf("Heap page size: %zu KB\n", stats->pagesize >> 10);
+  if (stats->tlb_misses < 0) {
+    printf("dTLB load misses: n/a (performance counters unavailable)\n");
+    return;
+  }
+  printf("dTLB load misses: %.0f (%.3f per op", stats->tlb_misses,
+         stats->tlb_misses / stats->ops);
+  if (stats->tlb_loads > 0)
+    printf(", %.4f%% of loads", 100.0 * stats->tlb_misses / stats->tlb_loads);
+  printf(")\n");
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1040,11 +2866,11 @@ static void unix_error(const char *fmt, ...) {
 /*
  * malloc_error - Report an error returned by the mm_malloc package
  */
-static void malloc_error(const trace_t *trace, int opnum, const char *fmt,
+static void malloc_error(const trace_t *trace, long opnum, const char *fmt,
                          ...) {
   va_list ap;
   va_start(ap, fmt);
-  printf("ERROR [trace %s, line %d]: ", trace->filename, LINENUM(opnum));
+  printf("ERROR [trace %s, line %ld]: ", trace->filename, LINENUM(opnum));
   vprintf(fmt, ap);
   putchar('\n');
   va_end(ap);
@@ -1054,12 +2880,29 @@ static void malloc_error(const trace_t *trace, int opnum, const char *fmt,
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hlVD] [-d <i>] [-v <i>] [-f <file>]\n");
+  fprintf(stderr,
+          "Usage: mdriver [-hlVBDGHMPRSt] [-d <i>] [-v <i>] [-s <n>] "
+          "[-m <file>] [-n <n>] [-T <file>] [-w <pct>] [-f <file>]\n");
   fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-B         Compare utilization with perfect allocator.\n");
   fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
   fprintf(stderr, "\t-D         Equivalent to -d2.\n");
+  fprintf(stderr, "\t-G         Like -P, keeping recorded gaps.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
+  fprintf(stderr, "\t-H         Back the heap with huge pages.\n");
   fprintf(stderr, "\t-l         Run libc malloc instead mm.\n");
+  fprintf(stderr, "\t-m <file>  Draw heap over time to SVG <file>.\n");
+  fprintf(stderr, "\t-M         Print allocator statistics.\n");
+  fprintf(stderr, "\t-n <n>     Sample heap for -m every <n> requests.\n");
+  fprintf(stderr, "\t-P         Also replay with a thread per recorded "
+                  "thread.\n");
+  fprintf(stderr, "\t-R         Compare with replay that frees by regions.\n");
+  fprintf(stderr, "\t-S         Back the heap with a shared memory file.\n");
+  fprintf(stderr, "\t-s <n>     Stream trace in chunks of <n> requests.\n");
+  fprintf(stderr, "\t-T <file>  Write calls traced in timed run to <file>.\n");
+  fprintf(stderr, "\t-t         Report page size and dTLB misses.\n");
+  fprintf(stderr, "\t-w <pct>   Also time replay that touches payloads and\n");
+  fprintf(stderr, "\t           reads <pct>%% of live blocks per request.\n");
   fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
   fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
   fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
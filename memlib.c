@@ -3,14 +3,17 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* for memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include "memlib.h"
 
@@ -18,26 +21,258 @@
 static unsigned char *heap;
 static unsigned char *mem_brk;
 static unsigned char *mem_max_addr;
+static unsigned char *mem_populated; /* end of populated huge pages */
+static int hugepages;                /* is heap backed by huge pages? */
+static int shared;                   /* is heap backed by a shared file? */
+static int shared_fd = -1;           /* file backing the shared heap */
+static int file_fd = -1;             /* file backing a persistent heap */
+
+/* Header kept in the page before a persistent heap, so reopening the file
+ * restores the heap size and the roots of the allocator */
+#define MEM_META_SIZE (1 << 12)
+#define MEM_MAGIC 0x31304d454d4d4dULL /* "MMMEM01" */
+
+typedef struct {
+  uint64_t magic;                     /* MEM_MAGIC in a valid file */
+  uint64_t heap_size;                 /* MAX_HEAP the file was made with */
+  uint64_t brk;                       /* heap size after last mem_sbrk */
+  unsigned char roots[MEM_ROOTS_SIZE]; /* kept for the allocator */
+} mem_meta_t;
+
+static mem_meta_t private_meta;       /* header of a heap that is not kept */
+static mem_meta_t *meta = &private_meta;
+
+/*
+ * mem_hugepages - request the heap to be backed by huge pages.
+ *    Must be called before mem_init.
+ */
+void mem_hugepages(int enable) {
+  hugepages = enable;
+}
+
+/*
+ * mem_map_hugepages - map the heap with huge pages. Use MAP_HUGETLB
+ *    if the system has huge pages reserved, otherwise reserve a region
+ *    aligned to huge page size and ask for transparent huge pages.
+ */
+static unsigned char *mem_map_hugepages(void) {
+  unsigned char *p, *start;
+
+#ifdef MAP_HUGETLB
+  p = mmap((void *)0x800000000, MAX_HEAP, PROT_WRITE,
+           MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED)
+    return p;
+#endif
+
+  /* Reserve one huge page more, so the region can be trimmed to alignment */
+  p = mmap((void *)0x800000000, MAX_HEAP + HUGEPAGE, PROT_WRITE,
+           MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED)
+    return p;
+
+  start = (unsigned char *)(((uintptr_t)p + HUGEPAGE - 1) & -HUGEPAGE);
+  if (start > p)
+    munmap(p, start - p);
+  munmap(start + MAX_HEAP, p + HUGEPAGE - start);
+
+  if (madvise(start, MAX_HEAP, MADV_HUGEPAGE) < 0) {
+    munmap(start, MAX_HEAP);
+    return MAP_FAILED;
+  }
+
+  return start;
+}
+
+/*
+ * mem_shared - request the heap to be backed by a memory file that other
+ *    processes can map with mem_attach. Must be called before mem_init.
+ */
+void mem_shared(int enable) {
+  shared = enable;
+}
+
+/*
+ * mem_map_shared - create an anonymous memory file of heap size and map
+ *    it shared. Use memfd_create if the system has it, otherwise a POSIX
+ *    shared memory object that is unlinked right after it is opened.
+ */
+static unsigned char *mem_map_shared(void) {
+  unsigned char *p;
+
+#ifdef MFD_CLOEXEC
+  shared_fd = memfd_create("mm-heap", 0);
+#else
+  char name[64];
+  snprintf(name, sizeof(name), "/mm-heap-%d", (int)getpid());
+  shared_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (shared_fd >= 0)
+    shm_unlink(name);
+#endif
+  if (shared_fd < 0)
+    return MAP_FAILED;
+
+  if (ftruncate(shared_fd, MAX_HEAP) < 0) {
+    close(shared_fd);
+    shared_fd = -1;
+    return MAP_FAILED;
+  }
+
+  p = mmap((void *)0x800000000, MAX_HEAP, PROT_READ | PROT_WRITE, MAP_SHARED,
+           shared_fd, 0);
+  if (p == MAP_FAILED) {
+    close(shared_fd);
+    shared_fd = -1;
+  }
+
+  return p;
+}
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
-  heap = mmap((void *)0x800000000,    /* suggested start */
-              MAX_HEAP,               /* length */
-              PROT_WRITE,             /* permissions */
-              MAP_PRIVATE | MAP_ANON, /* private or shared? */
-              -1,                     /* fd */
-              0);                     /* offset (dunno) */
+  heap = MAP_FAILED;
+
+  if (shared) {
+    heap = mem_map_shared();
+    if (heap == MAP_FAILED) {
+      fprintf(stderr, "WARNING: shared heap not available: %s\n",
+              strerror(errno));
+      shared = 0;
+    }
+  }
+
+  if (hugepages && heap == MAP_FAILED) {
+    heap = mem_map_hugepages();
+    if (heap == MAP_FAILED) {
+      fprintf(stderr, "WARNING: huge pages not available: %s\n",
+              strerror(errno));
+      hugepages = 0;
+    }
+  }
+
+  if (heap == MAP_FAILED)
+    heap = mmap((void *)0x800000000,    /* suggested start */
+                MAX_HEAP,               /* length */
+                PROT_WRITE,             /* permissions */
+                MAP_PRIVATE | MAP_ANON, /* private or shared? */
+                -1,                     /* fd */
+                0);                     /* offset (dunno) */
   mem_max_addr = heap + MAX_HEAP;
   mem_brk = heap; /* heap is empty initially */
+  mem_populated = heap;
+  meta = &private_meta;
+  memset(meta, 0, sizeof(mem_meta_t));
+}
+
+/*
+ * mem_open - initialize the memory system model with a heap kept in file
+ *    at path. An empty or missing file gets a new empty heap. Otherwise
+ *    the heap is mapped back with the size it had when last extended.
+ *    Returns 1 if an existing heap was opened, 0 if a new one was made
+ *    and -1 on error.
+ */
+int mem_open(const char *path) {
+  struct stat st;
+  unsigned char *p;
+  int fd;
+
+  if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+    return -1;
+  if (fstat(fd, &st) < 0)
+    goto fail;
+
+  int existing = st.st_size > 0;
+  if (existing && st.st_size != MEM_META_SIZE + MAX_HEAP) {
+    errno = EINVAL;
+    goto fail;
+  }
+  if (!existing && ftruncate(fd, MEM_META_SIZE + MAX_HEAP) < 0)
+    goto fail;
+
+  /* Ask for the usual heap address, so pointers kept in the heap hold */
+  p = mmap((void *)0x800000000 - MEM_META_SIZE, MEM_META_SIZE + MAX_HEAP,
+           PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    goto fail;
+
+  meta = (mem_meta_t *)p;
+  if (existing && (meta->magic != MEM_MAGIC || meta->heap_size != MAX_HEAP ||
+                   meta->brk > MAX_HEAP)) {
+    munmap(p, MEM_META_SIZE + MAX_HEAP);
+    meta = &private_meta;
+    errno = EINVAL;
+    goto fail;
+  }
+  if (!existing) {
+    meta->heap_size = MAX_HEAP;
+    meta->brk = 0;
+    meta->magic = MEM_MAGIC;
+  }
+
+  file_fd = fd;
+  heap = p + MEM_META_SIZE;
+  mem_max_addr = heap + MAX_HEAP;
+  mem_brk = heap + meta->brk;
+  mem_populated = heap;
+  return existing;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+/*
+ * mem_sync - write the heap and its header back to the file. Does nothing
+ *    if the heap is not kept in a file.
+ */
+int mem_sync(void) {
+  if (file_fd < 0)
+    return 0;
+  return msync((unsigned char *)meta, MEM_META_SIZE + (mem_brk - heap),
+               MS_SYNC);
+}
+
+/*
+ * mem_sync_meta - write only the heap header back to the file. Does
+ *    nothing if the heap is not kept in a file.
+ */
+int mem_sync_meta(void) {
+  if (file_fd < 0)
+    return 0;
+  return msync((unsigned char *)meta, MEM_META_SIZE, MS_SYNC);
 }
 
 /*
- * mem_deinit - free the storage used by the memory system model
+ * mem_roots - returns MEM_ROOTS_SIZE bytes kept in the heap header,
+ *    where the allocator stores what it needs to reopen the heap
+ */
+void *mem_roots(void) {
+  return meta->roots;
+}
+
+/*
+ * mem_deinit - free the storage used by the memory system model, does
+ *    nothing if it is already freed
  */
 void mem_deinit(void) {
+  if (heap == NULL)
+    return;
+  if (file_fd >= 0) {
+    munmap(heap - MEM_META_SIZE, MEM_META_SIZE + MAX_HEAP);
+    close(file_fd);
+    file_fd = -1;
+    meta = &private_meta;
+    heap = NULL;
+    return;
+  }
   munmap(heap, MAX_HEAP);
+  heap = NULL;
+  if (shared_fd >= 0) {
+    close(shared_fd);
+    shared_fd = -1;
+  }
 }
 
 /*
@@ -45,6 +280,7 @@ void mem_deinit(void) {
  */
 void mem_reset_brk() {
   mem_brk = heap;
+  meta->brk = 0;
 }
 
 /*
@@ -62,6 +298,19 @@ void *mem_sbrk(long incr) {
   }
 
   mem_brk += incr;
+  meta->brk = mem_brk - heap;
+
+#ifdef MADV_POPULATE_WRITE
+  /* Grow backing memory in whole huge pages as the heap crosses them */
+  if (hugepages && mem_brk > mem_populated) {
+    size_t len = (mem_brk - mem_populated + HUGEPAGE - 1) & -HUGEPAGE;
+    if (mem_populated + len > mem_max_addr)
+      len = mem_max_addr - mem_populated;
+    madvise(mem_populated, len, MADV_POPULATE_WRITE);
+    mem_populated += len;
+  }
+#endif
+
   return (void *)old_brk;
 }
 
@@ -87,8 +336,46 @@ size_t mem_heapsize() {
 }
 
 /*
- * mem_pagesize() - returns the page size of the system
+ * mem_pagesize() - returns the size of pages backing the heap
  */
 size_t mem_pagesize() {
-  return (size_t)getpagesize();
+  return hugepages ? HUGEPAGE : (size_t)getpagesize();
+}
+
+/*
+ * mem_fd - returns the file backing a shared heap, or -1 if heap is private
+ */
+int mem_fd(void) {
+  return shared_fd;
+}
+
+/*
+ * mem_attach - map a shared heap from file fd, most likely at an address
+ *    different from the one used by its owner. Returns NULL on failure.
+ */
+void *mem_attach(int fd) {
+  void *p = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * mem_detach - unmap a shared heap mapped by mem_attach
+ */
+void mem_detach(void *base) {
+  munmap(base, MAX_HEAP);
+}
+
+/*
+ * mem_handle - returns the offset of p from the start of the heap
+ */
+mem_handle_t mem_handle(void *p) {
+  return (unsigned char *)p - heap;
+}
+
+/*
+ * mem_handle_ptr - returns the address of handle h in a heap mapped at base
+ */
+void *mem_handle_ptr(void *base, mem_handle_t h) {
+  return (unsigned char *)base + h;
 }
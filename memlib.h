@@ -12,7 +12,29 @@
  */
 #define MAX_HEAP (100 * (1 << 20)) /* 100 MB */
 
+/*
+ * Size of a huge page used to back the heap if requested
+ */
+#define HUGEPAGE (1 << 21) /* 2 MB */
+
+/*
+ * Bytes of a persistent heap header kept for the allocator
+ */
+#define MEM_ROOTS_SIZE 256
+
+/*
+ * Position independent reference to a heap byte, valid in every process
+ * that maps a shared heap
+ */
+typedef size_t mem_handle_t;
+
+void mem_hugepages(int enable);
+void mem_shared(int enable);
 void mem_init(void);
+int mem_open(const char *path);
+int mem_sync(void);
+int mem_sync_meta(void);
+void *mem_roots(void);
 void mem_deinit(void);
 void *mem_sbrk(long incr);
 void mem_reset_brk(void);
@@ -20,3 +42,8 @@ void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+int mem_fd(void);
+void *mem_attach(int fd);
+void mem_detach(void *base);
+mem_handle_t mem_handle(void *p);
+void *mem_handle_ptr(void *base, mem_handle_t h);
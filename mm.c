@@ -18,6 +18,15 @@ in free block list. I compressed information about addresses to 4 bytes
 per address (I store only offsets to the beginning of the heap).
 
 For search I use FIFO explicit free lists with best find policy.
+Best fit does not walk the list: sizes and offsets of free blocks are
+mirrored in a dense side array, which is scanned with SSE4/AVX2 kernels
+picked at runtime.
+Other placement policies (first, next, address ordered and good fit)
+can be selected at compile time with -DPLACEMENT=...
+The last free block before the epilogue (wilderness) is used only when
+no other free block fits, so small requests do not chip it away.
+Blocks that grow with realloc are moved to the top of the heap, where
+they can be extended in place next time.
 
 I implemented many optimizations for realloc. I am trying to keep
 memory in place without copying it elsewhere. If realloc call decreases
@@ -25,9 +34,32 @@ size of memory block I try to make a split and make a new free block.
 When realloc call increases size of memory block I try to either use
 next block (if it is free) or expand heap (if realloc was called on
 last block).
+
+Aligned allocation (memalign) looks for a free block that can hold
+a payload starting at a requested alignment. Leading gap in such a block
+is split off as a separate free block instead of being wasted.
+
+Optional buddy tier (-DBUDDY_TIER) serves medium sized requests from
+power of two blocks carved out of large arenas taken from the heap.
+It trades utilization for O(1) split and merge without list searches.
+
+Regions (mm_region_*) bump allocate from large blocks taken from the heap
+and give all of them back at once when the region is destroyed.
+Pools (mm_pool_*) serve objects of one size from page sized slabs with
+intrusive free lists, optionally behind a thread-local cache.
+Pools of whole cache lines back mm_malloc_isolated, for data written
+by different threads that must not share a line.
+Cheap counters (mm_stats) track free bytes and blocks, heap extensions,
+realloc outcomes and size class histograms, per thread with THREADS.
+Optional tracepoints (-DTRACEPOINTS) record cost and path of each call
+in a ring buffer read with mm_trace_read.
+Heap kept in a file (mem_open) is reopened with mm_open, which finds all
+allocator state in the heap and a small roots header saved by
+mm_checkpoint, and refuses a heap changed after its last checkpoint.
 */
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +67,21 @@ last block).
 #include <stdint.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#if THREADS
+#include <pthread.h>
+#endif
+#if TRACEPOINTS
+#include <time.h>
+#endif
+#if TRACEPOINTS && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -55,8 +102,23 @@ last block).
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
 #endif /* def DRIVER */
 
+/* Record every call in a ring buffer, see mm_trace_read */
+#ifndef TRACEPOINTS
+#define TRACEPOINTS 0
+#endif
+
+#ifndef TRACE_ENTRIES
+#define TRACE_ENTRIES (1 << 16) /* Power of two */
+#endif
+
+/* Allocator may be used by many threads */
+#ifndef THREADS
+#define THREADS 0
+#endif
+
 /* Basic constants and macros */
 #define WSIZE 4            /* Word and header/footer size (bytes) */
 #define DSIZE 8            /* Double word size (bytes) */
@@ -64,8 +126,80 @@ last block).
 
 #define FREE 0
 #define ALLOCATED 1
+#define BUDDY 4 /* Header flag of blocks that belong to buddy tier */
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* Placement policies, pick one at build time with -DPLACEMENT=... */
+#define FIRST_FIT 1   /* First fitting block in FIFO order */
+#define NEXT_FIT 2    /* First fit, starting where last search ended */
+#define ADDRESS_FIT 3 /* First fit in address ordered free list */
+#define BEST_FIT 4    /* Smallest fitting block */
+#define GOOD_FIT 5    /* Smallest of first GOOD_FIT_CANDIDATES fits */
+
+#ifndef PLACEMENT
+#define PLACEMENT BEST_FIT
+#endif
+
+#ifndef GOOD_FIT_CANDIDATES
+#define GOOD_FIT_CANDIDATES 8
+#endif
+
+/* Medium sized blocks may be served by buddy system, see buddy_malloc */
+#ifndef BUDDY_TIER
+#define BUDDY_TIER 0
+#endif
+
+#ifndef BUDDY_MIN_ORDER
+#define BUDDY_MIN_ORDER 10 /* Smallest buddy block is 1 KiB */
+#endif
+
+#ifndef BUDDY_MAX_ORDER
+#define BUDDY_MAX_ORDER 16 /* Largest buddy block is 64 KiB */
+#endif
+
+/* Regions take memory from the heap in chunks of this size */
+#ifndef REGION_CHUNKSIZE
+#define REGION_CHUNKSIZE (1 << 16)
+#endif
+
+/* Pools take memory from the heap in aligned slabs of this size */
+#ifndef POOL_SLAB
+#define POOL_SLAB (1 << 12)
+#endif
+
+/* Thread-local cache of freed pool objects in front of the slabs */
+#ifndef POOL_CACHE
+#define POOL_CACHE 0
+#endif
+
+#ifndef POOL_CACHE_SIZE
+#define POOL_CACHE_SIZE 32 /* Objects cached per pool */
+#endif
+
+#ifndef POOL_CACHE_WAYS
+#define POOL_CACHE_WAYS 8 /* Pools cached at once, chosen by pool id */
+#endif
+
+/* Isolated blocks own whole cache lines, see mm_malloc_isolated */
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+#ifndef LINE_CLASSES
+#define LINE_CLASSES 8 /* Pools of 1 to LINE_CLASSES cache lines */
+#endif
+
+/* Largest heap the memory source may grow to, memlib.c gives MAX_HEAP */
+#ifndef HEAP_LIMIT
+#define HEAP_LIMIT MAX_HEAP
+#endif
+
+/* Best fit scans a dense array of free block sizes instead of the list */
+#ifndef SIZE_INDEX
+#define SIZE_INDEX (PLACEMENT == BEST_FIT)
+#endif
 
 /* Read and write a word at address p */
 #define GET(p) (*(unsigned int *)(p))
@@ -98,6 +232,13 @@ static char *heap_listp;
 static size_t last_prev_alloc = 1;
 static void *sentinel_pointer;
 static void *epilogue_pointer;
+#if PLACEMENT == NEXT_FIT
+static void *rover; /* Free block where next search starts */
+#endif
+#if !SIZE_INDEX
+static void *trim_next; /* Free block where next mm_trim starts */
+#endif
+static mm_pool_t *line_pools[LINE_CLASSES]; /* See mm_malloc_isolated */
 
 // Given block ptr compute address of next free block in list
 static inline void *get_next_free_blkp(void *bp) {
@@ -168,6 +309,13 @@ static inline bool is_block_last(void *bp) {
   return GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0;
 }
 
+// Get the free block adjacent to the epilogue or NULL if there is none
+static inline void *get_wilderness(void) {
+  if (GET_PREV_ALLOC(HDRP(epilogue_pointer)))
+    return NULL;
+  return PREV_BLKP(epilogue_pointer);
+}
+
 // Get a proper size for heap extension
 static inline size_t get_extendsize(size_t size) {
   return MAX(size, CHUNKSIZE) / WSIZE;
@@ -183,17 +331,401 @@ static inline size_t get_adjusted_size(size_t size) {
   return asize;
 }
 
+#if SIZE_INDEX
+/* Size index keeps sizes and offsets of free blocks in two parallel arrays,
+ * so best fit can scan sizes with SIMD instead of chasing list pointers.
+ * Free block at the top of the heap (wilderness) is not indexed. Free blocks
+ * are never adjacent, hence there is at most one per 2 * ALIGNMENT bytes,
+ * and offset / (2 * ALIGNMENT) picks a slot of free_slots, which tells
+ * where in the arrays the block is, so removal takes constant time. */
+#define SIZE_INDEX_MAX (HEAP_LIMIT / (2 * ALIGNMENT))
+#define SIZE_INDEX_SLOT(off) ((off) / (2 * ALIGNMENT))
+
+static unsigned int *free_sizes; /* Sizes of indexed free blocks */
+static unsigned int *free_offs;  /* Offsets of indexed free blocks */
+static unsigned int *free_slots; /* Index entry of block, by its offset */
+static int free_count;           /* Number of indexed free blocks */
+static void *free_top;           /* Free block at the top of the heap */
+
+// Merge per-lane results of a vector scan with scalar scan from index i
+static int best_size_merge(const unsigned int *lane_size, const int *lane_idx,
+                           int lanes, const unsigned int *sizes, int i, int n,
+                           unsigned int asize) {
+  unsigned int best_size = UINT_MAX;
+  int best = -1;
+
+  for (int l = 0; l < lanes; l++) {
+    if (lane_size[l] < best_size) {
+      best_size = lane_size[l];
+      best = lane_idx[l];
+    }
+  }
+
+  for (; i < n && best_size != asize; i++) {
+    if (asize <= sizes[i] && sizes[i] < best_size) {
+      best_size = sizes[i];
+      best = i;
+    }
+  }
+
+  return best;
+}
+
+// Find index of smallest size not less than asize or -1 if there is none
+static int best_size_scalar(const unsigned int *sizes, int n,
+                            unsigned int asize) {
+  return best_size_merge(NULL, NULL, 0, sizes, 0, n, asize);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.1"))) static int
+best_size_sse4(const unsigned int *sizes, int n, unsigned int asize) {
+  const __m128i ones = _mm_set1_epi32(-1);
+  const __m128i need = _mm_set1_epi32(asize);
+  const __m128i step = _mm_set1_epi32(4);
+  __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+  __m128i best = ones;
+  __m128i best_idx = ones;
+  unsigned int lane_size[4];
+  int lane_idx[4];
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i size = _mm_loadu_si128((const __m128i *)(sizes + i));
+    // Sizes that do not fit become UINT_MAX
+    __m128i fit = _mm_cmpeq_epi32(_mm_max_epu32(size, need), size);
+    __m128i cand = _mm_or_si128(size, _mm_xor_si128(fit, ones));
+    // Lanes that did not get smaller keep their index
+    __m128i keep = _mm_cmpeq_epi32(_mm_min_epu32(cand, best), best);
+    best = _mm_min_epu32(cand, best);
+    best_idx = _mm_blendv_epi8(idx, best_idx, keep);
+    idx = _mm_add_epi32(idx, step);
+    // Nothing is better than an exact fit
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(cand, need))) {
+      i = n;
+      break;
+    }
+  }
+
+  _mm_storeu_si128((__m128i *)lane_size, best);
+  _mm_storeu_si128((__m128i *)lane_idx, best_idx);
+  return best_size_merge(lane_size, lane_idx, 4, sizes, i, n, asize);
+}
+
+__attribute__((target("avx2"))) static int
+best_size_avx2(const unsigned int *sizes, int n, unsigned int asize) {
+  const __m256i ones = _mm256_set1_epi32(-1);
+  const __m256i need = _mm256_set1_epi32(asize);
+  const __m256i step = _mm256_set1_epi32(8);
+  __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i best = ones;
+  __m256i best_idx = ones;
+  unsigned int lane_size[8];
+  int lane_idx[8];
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i size = _mm256_loadu_si256((const __m256i *)(sizes + i));
+    // Sizes that do not fit become UINT_MAX
+    __m256i fit = _mm256_cmpeq_epi32(_mm256_max_epu32(size, need), size);
+    __m256i cand = _mm256_or_si256(size, _mm256_xor_si256(fit, ones));
+    // Lanes that did not get smaller keep their index
+    __m256i keep = _mm256_cmpeq_epi32(_mm256_min_epu32(cand, best), best);
+    best = _mm256_min_epu32(cand, best);
+    best_idx = _mm256_blendv_epi8(idx, best_idx, keep);
+    idx = _mm256_add_epi32(idx, step);
+    // Nothing is better than an exact fit
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(cand, need))) {
+      i = n;
+      break;
+    }
+  }
+
+  _mm256_storeu_si256((__m256i *)lane_size, best);
+  _mm256_storeu_si256((__m256i *)lane_idx, best_idx);
+  return best_size_merge(lane_size, lane_idx, 8, sizes, i, n, asize);
+}
+#endif
+
+/* Kernels are picked at runtime according to what the CPU supports */
+static int (*size_index_best)(const unsigned int *, int,
+                              unsigned int) = best_size_scalar;
+
+// Prepare an empty size index
+static int size_index_init(void) {
+  if (free_sizes == NULL) {
+    void *p = mmap(NULL, 3 * SIZE_INDEX_MAX * sizeof(unsigned int),
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+      return -1;
+    free_sizes = p;
+    free_offs = free_sizes + SIZE_INDEX_MAX;
+    free_slots = free_offs + SIZE_INDEX_MAX;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      size_index_best = best_size_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+      size_index_best = best_size_sse4;
+    }
+#endif
+  }
+
+  free_count = 0;
+  free_top = NULL;
+  return 0;
+}
+
+// Add free block to size index, block at the top of the heap is kept aside
+static inline void size_index_add(void *bp) {
+  if (NEXT_BLKP(bp) == epilogue_pointer) {
+    free_top = bp;
+    return;
+  }
+  unsigned int off = (char *)bp - (char *)mem_heap_lo();
+  free_sizes[free_count] = GET_SIZE(HDRP(bp));
+  free_offs[free_count] = off;
+  free_slots[SIZE_INDEX_SLOT(off)] = free_count;
+  free_count++;
+}
+
+// Remove free block from size index, last entry fills the hole
+static inline void size_index_remove(void *bp) {
+  if (bp == free_top) {
+    free_top = NULL;
+    return;
+  }
+  unsigned int off = (char *)bp - (char *)mem_heap_lo();
+  int i = free_slots[SIZE_INDEX_SLOT(off)];
+  free_count--;
+  free_sizes[i] = free_sizes[free_count];
+  free_offs[i] = free_offs[free_count];
+  free_slots[SIZE_INDEX_SLOT(free_offs[i])] = i;
+}
+#endif
+
+/* Statistics counters are bumped on the allocator's paths and read with
+ * mm_stats. Values that describe the heap (free bytes and blocks) are kept
+ * as changes, so with THREADS every thread updates only its own counters
+ * and mm_stats adds up counters of all threads, without locking the heap.
+ * Counters of threads that exit are folded into stats_retired. */
+typedef struct stats_counters {
+  long free_bytes;
+  long free_blocks;
+  long extensions;
+  long mallocs;
+  long frees;
+  long realloc_in_place;
+  long realloc_copies;
+  long malloc_hist[MM_STATS_CLASSES];
+  long free_hist[MM_STATS_CLASSES];
+#if THREADS
+  struct stats_counters *next; /* Next thread with counters */
+#endif
+} stats_counters_t;
+
+#define STATS_FIELDS offsetof(stats_counters_t, free_hist[MM_STATS_CLASSES])
+
+#if THREADS
+static __thread stats_counters_t thread_stats;
+static __thread bool thread_stats_linked;
+static stats_counters_t *stats_threads; /* Threads with counters */
+static stats_counters_t stats_retired;  /* Sum of threads that exited */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+// Move counters of exiting thread to stats_retired
+static void stats_thread_exit(void *arg) {
+  stats_counters_t *c = arg;
+  long *dst = (long *)&stats_retired;
+  long *src = (long *)c;
+
+  pthread_mutex_lock(&stats_lock);
+  for (size_t i = 0; i < STATS_FIELDS / sizeof(long); i++)
+    dst[i] += src[i];
+  for (stats_counters_t **p = &stats_threads; *p; p = &(*p)->next) {
+    if (*p == c) {
+      *p = c->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_key_create(void) {
+  pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+// Link counters of calling thread in on first use
+static stats_counters_t *stats_link(void) {
+  pthread_once(&stats_once, stats_key_create);
+  pthread_mutex_lock(&stats_lock);
+  thread_stats.next = stats_threads;
+  stats_threads = &thread_stats;
+  pthread_mutex_unlock(&stats_lock);
+  pthread_setspecific(stats_key, &thread_stats);
+  thread_stats_linked = true;
+  return &thread_stats;
+}
+
+// Get counters of calling thread
+static inline stats_counters_t *stats(void) {
+  if (__builtin_expect(thread_stats_linked, 1))
+    return &thread_stats;
+  return stats_link();
+}
+#else
+static stats_counters_t global_stats;
+
+// Get counters
+static inline stats_counters_t *stats(void) {
+  return &global_stats;
+}
+#endif
+
+// Get histogram class of a size, classes grow in powers of two from 16
+static inline int stats_class(size_t size) {
+  int class = 59 - __builtin_clzl(size | ALIGNMENT);
+  return MIN(class, MM_STATS_CLASSES - 1);
+}
+
+// Forget all counters, heap starts from scratch
+static void stats_reset(void) {
+#if THREADS
+  pthread_mutex_lock(&stats_lock);
+  for (stats_counters_t *c = stats_threads; c; c = c->next)
+    memset(c, 0, STATS_FIELDS);
+  memset(&stats_retired, 0, STATS_FIELDS);
+  pthread_mutex_unlock(&stats_lock);
+#else
+  memset(&global_stats, 0, STATS_FIELDS);
+#endif
+}
+
+// Count free block that joins (sign 1) or leaves (sign -1) free list
+static inline void stats_free_block(void *bp, long sign) {
+  stats_counters_t *c = stats();
+  size_t size = GET_SIZE(HDRP(bp));
+  c->free_bytes += sign * (long)size;
+  c->free_blocks += sign;
+  c->free_hist[stats_class(size)] += sign;
+}
+
+/* Tracepoints time each outermost call with the cycle counter and write
+ * an event to a ring buffer. Writers claim a slot with an atomic add, so
+ * no lock is taken and old events are overwritten. Inner calls (realloc
+ * calls malloc and free) only add bits to the path of the outer one.
+ * When <sys/sdt.h> is available, every event also fires a USDT probe
+ * mm:call. With TRACEPOINTS off, all of it compiles to nothing. */
+#if TRACEPOINTS
+#define TRACED(fn) fn##_untraced
+
+static void *malloc_untraced(size_t size);
+static void *memalign_untraced(size_t alignment, size_t size);
+static void free_untraced(void *bp);
+static void *realloc_untraced(void *old_ptr, size_t size);
+
+static mm_trace_event_t trace_ring[TRACE_ENTRIES];
+static unsigned long trace_head; /* Events written since mm_init */
+
+#if THREADS
+static __thread int trace_depth;
+static __thread unsigned int trace_path;
+#else
+static int trace_depth;
+static unsigned int trace_path;
+#endif
+
+// Read cycle counter
+static inline unsigned long trace_clock(void) {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+// Start timing a call, inner calls are not timed on their own
+static inline unsigned long trace_begin(void) {
+  if (trace_depth++ == 0) {
+    trace_path = 0;
+    return trace_clock();
+  }
+  return 0;
+}
+
+// Finish timing a call and record it if it is the outermost one
+static inline void trace_end(unsigned long start, int op, size_t size,
+                             void *result) {
+  if (--trace_depth > 0)
+    return;
+
+  unsigned long cycles = trace_clock() - start;
+  unsigned long i = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+  mm_trace_event_t *e = &trace_ring[i & (TRACE_ENTRIES - 1)];
+  e->cycles = cycles;
+  e->size = size;
+  e->result = result;
+  e->op = op;
+  e->path = trace_path;
+
+#ifdef DTRACE_PROBE5
+  DTRACE_PROBE5(mm, call, op, size, result, trace_path, cycles);
+#endif
+}
+
+#define TRACE_PATH(bit) (trace_path |= (bit))
+#else
+#define TRACED(fn) fn
+#define TRACE_PATH(bit)
+#endif
+
+// Add block to free block list
 static inline void add_block_to_free_list(void *new) {
-  set_next_free_blkp(new, sentinel_pointer);
-  set_prev_free_blkp(new, get_prev_free_blkp(sentinel_pointer));
-  set_prev_free_blkp(sentinel_pointer, new);
+  void *next = sentinel_pointer;
+
+#if PLACEMENT == ADDRESS_FIT
+  // Keep free block list sorted by address
+  for (next = get_next_free_blkp(sentinel_pointer);
+       next != sentinel_pointer && next < new; next = get_next_free_blkp(next))
+    ;
+#endif
+
+  set_next_free_blkp(new, next);
+  set_prev_free_blkp(new, get_prev_free_blkp(next));
+  set_prev_free_blkp(next, new);
   set_next_free_blkp(get_prev_free_blkp(new), new);
+
+#if SIZE_INDEX
+  size_index_add(new);
+#endif
+  stats_free_block(new, 1);
 }
 
-// Add block to free block list
+// Remove block from free block list
 static inline void remove_block_from_free_list(void *rem) {
+#if PLACEMENT == NEXT_FIT
+  // Rover must always point at a block on the list
+  if (rover == rem)
+    rover = get_next_free_blkp(rem);
+#endif
+#if !SIZE_INDEX
+  if (trim_next == rem)
+    trim_next = get_next_free_blkp(rem);
+#endif
+
   set_next_free_blkp(get_prev_free_blkp(rem), get_next_free_blkp(rem));
   set_prev_free_blkp(get_next_free_blkp(rem), get_prev_free_blkp(rem));
+
+#if SIZE_INDEX
+  size_index_remove(rem);
+#endif
+  stats_free_block(rem, -1);
 }
 
 // Try to merge a given free block with adjacent ones
@@ -209,6 +741,7 @@ static void *coalesce(void *bp) {
 
   // Merge with next block
   else if (prev_alloc && !next_alloc) {
+    TRACE_PATH(MM_PATH_MERGE);
     size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
     remove_block_from_free_list(NEXT_BLKP(bp));
     make_free_block(bp, size, prev_alloc);
@@ -216,6 +749,7 @@ static void *coalesce(void *bp) {
 
   // Merge with previous block
   else if (!prev_alloc && next_alloc) {
+    TRACE_PATH(MM_PATH_MERGE);
     set_prev_alloc(NEXT_BLKP(bp), FREE);
     size += GET_SIZE(HDRP(PREV_BLKP(bp)));
     size_t prevblk_prev_alloc = GET_PREV_ALLOC(HDRP(PREV_BLKP(bp)));
@@ -226,6 +760,7 @@ static void *coalesce(void *bp) {
 
   // Full merge
   else {
+    TRACE_PATH(MM_PATH_MERGE);
     size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
     size_t prevblk_prev_alloc = GET_PREV_ALLOC(HDRP(PREV_BLKP(bp)));
     remove_block_from_free_list(PREV_BLKP(bp));
@@ -246,6 +781,8 @@ static void *extend_heap(size_t words) {
   size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
   if ((long)(bp = mem_sbrk(size)) == -1)
     return NULL;
+  stats()->extensions++;
+  TRACE_PATH(MM_PATH_EXTEND);
 
   // Initialize new free block header/footer and the epilogue header
   make_free_block(bp, size, last_prev_alloc);
@@ -255,139 +792,744 @@ static void *extend_heap(size_t words) {
   return coalesce(bp);
 }
 
-// Find smallest valid free block in free block list
-static void *find_best(size_t asize) {
+// Round block ptr up to a multiple of alignment (power of two)
+static inline void *align_blkp(void *bp, size_t alignment) {
+  return (void *)(((uintptr_t)bp + alignment - 1) & ~(alignment - 1));
+}
+
+// Check if free block of given size holds asize bytes at aligned address
+static inline bool fits(void *bp, size_t size, size_t asize,
+                        size_t alignment) {
+  // Every block ptr is aligned to ALIGNMENT, so there is no gap then
+  size_t gap = alignment > ALIGNMENT ? align_blkp(bp, alignment) - bp : 0;
+  return gap + asize <= size;
+}
+
+// Use the wilderness only if no other free block fits
+static inline void *fit_wilderness(void *wilderness, size_t asize,
+                                   size_t alignment) {
+  if (wilderness && fits(wilderness, GET_SIZE(HDRP(wilderness)), asize,
+                         alignment))
+    return wilderness;
+  return NULL;
+}
+
+/* Search loops below are always inlined, so calls with constant alignment
+ * from malloc compile into a loop specialized for the placement policy. */
 
+#if PLACEMENT == FIRST_FIT || PLACEMENT == ADDRESS_FIT
+// Find first valid free block in free block list, wilderness goes last
+static inline __attribute__((always_inline)) void *find_fit(size_t asize,
+                                                            size_t alignment) {
+  void *bp;
+  void *wilderness = get_wilderness();
+
+  for (bp = get_next_free_blkp(sentinel_pointer); bp != sentinel_pointer;
+       bp = get_next_free_blkp(bp)) {
+    if (fits(bp, GET_SIZE(HDRP(bp)), asize, alignment) && bp != wilderness)
+      return bp;
+  }
+
+  return fit_wilderness(wilderness, asize, alignment);
+}
+#elif PLACEMENT == NEXT_FIT
+// Find first valid free block starting where last search ended
+static inline __attribute__((always_inline)) void *find_fit(size_t asize,
+                                                            size_t alignment) {
+  void *bp = rover;
+  void *wilderness = get_wilderness();
+
+  do {
+    if (bp != sentinel_pointer && bp != wilderness &&
+        fits(bp, GET_SIZE(HDRP(bp)), asize, alignment)) {
+      rover = get_next_free_blkp(bp);
+      return bp;
+    }
+    bp = get_next_free_blkp(bp);
+  } while (bp != rover);
+
+  return fit_wilderness(wilderness, asize, alignment);
+}
+#else
+// Find smallest valid free block in free block list, wilderness goes last
+static inline __attribute__((always_inline)) void *find_fit(size_t asize,
+                                                            size_t alignment) {
   void *bp;
   void *best_bp = NULL;
+  void *wilderness = get_wilderness();
   size_t best_size = (size_t)-1;
+#if PLACEMENT == GOOD_FIT
+  int candidates = GOOD_FIT_CANDIDATES;
+#endif
+
+#if SIZE_INDEX
+  // Plain requests scan sizes of free blocks other than the wilderness
+  if (alignment <= ALIGNMENT) {
+    int i = size_index_best(free_sizes, free_count, asize);
+    if (i >= 0)
+      return (char *)mem_heap_lo() + free_offs[i];
+    return fit_wilderness(wilderness, asize, alignment);
+  }
+
+  // Aligned requests look at blocks only if their size may fit
+  for (int i = 0; i < free_count; i++) {
+    size_t current_size = free_sizes[i];
+    if (current_size < asize || current_size >= best_size)
+      continue;
+    bp = (char *)mem_heap_lo() + free_offs[i];
+    if (!fits(bp, current_size, asize, alignment))
+      continue;
+    best_size = current_size;
+    best_bp = bp;
+    // Nothing is better than an exact fit
+    if (current_size == asize)
+      break;
+  }
+
+  if (best_bp == NULL)
+    best_bp = fit_wilderness(wilderness, asize, alignment);
+
+  return best_bp;
+#endif
 
   for (bp = get_next_free_blkp(sentinel_pointer); bp != sentinel_pointer;
        bp = get_next_free_blkp(bp)) {
     size_t current_size = GET_SIZE(HDRP(bp));
-    if (asize <= current_size && current_size < best_size) {
+    if (!fits(bp, current_size, asize, alignment) || bp == wilderness)
+      continue;
+    if (current_size < best_size) {
       best_size = current_size;
       best_bp = bp;
+      // Nothing is better than an exact fit
+      if (current_size == asize)
+        break;
     }
+#if PLACEMENT == GOOD_FIT
+    // Good fit settles for the best of first few candidates
+    if (--candidates == 0)
+      break;
+#endif
   }
 
+  if (best_bp == NULL)
+    best_bp = fit_wilderness(wilderness, asize, alignment);
+
   return best_bp;
 }
+#endif
 
 // Place new allocated block at the place of a free one
 static void place(void *bp, size_t asize) {
   size_t csize = GET_SIZE(HDRP(bp));
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
 
   remove_block_from_free_list(bp);
 
   // If free block is big enough make a split
   if (csize >= ALIGNMENT + asize) {
-    make_allocated_block(bp, asize, ALLOCATED);
+    make_allocated_block(bp, asize, prev_alloc);
     bp = NEXT_BLKP(bp);
     make_free_block(bp, csize - asize, ALLOCATED);
     add_block_to_free_list(bp);
   } else {
-    make_allocated_block(bp, csize, ALLOCATED);
+    make_allocated_block(bp, csize, prev_alloc);
     set_prev_alloc(NEXT_BLKP(bp), ALLOCATED);
   }
 }
 
-// mm_init - Called when a new trace starts.
-int mm_init(void) {
-  last_prev_alloc = 1;
-  sentinel_pointer = mem_heap_lo() + 2 * WSIZE;
+// Allocate a block that is expected to grow, preferably at the top of heap
+static void *malloc_top(size_t size) {
+  void *bp = get_wilderness();
+  size_t asize = get_adjusted_size(size);
 
-  if ((heap_listp = mem_sbrk(2 * ALIGNMENT)) == (void *)-1)
-    return -1;
+  if (bp == NULL || GET_SIZE(HDRP(bp)) < asize)
+    return malloc(size);
 
-  PUT(heap_listp, 0);                                     // Alignment padding
-  make_sentinel_block(heap_listp + 2 * WSIZE);            // Sentinel block
-  make_prologue_block(heap_listp + 6 * WSIZE);            // Prologue header
-  make_epilogue_block(heap_listp + 8 * WSIZE, ALLOCATED); // Epilogue header
+  // Count the request as malloc does, whichever branch serves it
+  stats_counters_t *c = stats();
+  c->mallocs++;
+  c->malloc_hist[stats_class(size)]++;
 
-  heap_listp += (6 * WSIZE);
+  place(bp, asize);
+  return bp;
+}
 
-  // Extend the empty heap with a free block of CHUNKSIZE bytes
-  if (extend_heap(CHUNKSIZE / WSIZE) == NULL)
-    return -1;
+// Place new allocated block at aligned address inside of a free one
+static void *place_aligned(void *bp, size_t asize, size_t alignment) {
+  void *abp = align_blkp(bp, alignment);
+  size_t gap = abp - bp;
+
+  // Leading gap is a multiple of ALIGNMENT, so it can become a free block
+  if (gap > 0) {
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    remove_block_from_free_list(bp);
+    make_free_block(bp, gap, prev_alloc);
+    add_block_to_free_list(bp);
+    make_free_block(abp, csize - gap, FREE);
+    add_block_to_free_list(abp);
+  }
 
-  return 0;
+  place(abp, asize);
+  return abp;
 }
 
-// malloc - Allocate a block of a given size
-void *malloc(size_t size) {
-  char *bp;
+#if BUDDY_TIER
+/* Buddy tier serves requests whose block (payload and header word) takes
+ * between 2^BUDDY_MIN_ORDER and 2^BUDDY_MAX_ORDER bytes. Buddy blocks live
+ * in arenas, which are ordinary allocated blocks taken from the heap.
+ * Header of a buddy block holds BUDDY flag, alloc bit, order and position
+ * of the block in its arena, so free and realloc can tell it apart from
+ * boundary tag blocks. Free blocks of each order are kept on a doubly linked
+ * list and every arena has a bitmap with a bit set where a free block
+ * starts, so finding a free buddy never needs a list scan. */
+#define BUDDY_ORDERS (BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1)
+#define BUDDY_TOPS 4 /* Number of largest blocks in an arena */
+#define BUDDY_AREA (BUDDY_TOPS << BUDDY_MAX_ORDER)
+#define BUDDY_MAP_BITS (BUDDY_AREA >> BUDDY_MIN_ORDER)
+
+typedef struct {
+  unsigned int next;                          /* Offset of next arena */
+  unsigned int used;                          /* Allocated blocks in arena */
+  uint64_t map[(BUDDY_MAP_BITS + 63) / 64];   /* Starts of free blocks */
+} buddy_arena_t;
+
+/* Blocks start WSIZE bytes before an aligned address, so payloads just
+ * after the header word are aligned */
+#define BUDDY_AREA_OFFSET                                                      \
+  (ALIGNMENT * ((sizeof(buddy_arena_t) + ALIGNMENT - 1) / ALIGNMENT) +         \
+   ALIGNMENT - WSIZE)
+
+#define BUDDY_SERVES(size)                                                     \
+  ((size) + WSIZE >= (1 << BUDDY_MIN_ORDER) &&                                 \
+   (size) + WSIZE <= (1 << BUDDY_MAX_ORDER))
+
+static unsigned int buddy_arenas;              /* Offset of first arena */
+static unsigned int buddy_lists[BUDDY_ORDERS]; /* Offsets of free blocks */
+
+// Convert heap offset to pointer, zero offset stands for NULL
+static inline void *buddy_ptr(unsigned int off) {
+  return off ? mem_heap_lo() + off : NULL;
+}
 
-  // Ignore spurious requests
-  if (size == 0)
-    return NULL;
+// Convert pointer to heap offset
+static inline unsigned int buddy_off(void *p) {
+  return p - mem_heap_lo();
+}
 
-  // Adjust block size to include overhead and alignment reqs
-  size_t asize = get_adjusted_size(size);
+// Get the smallest order of a block that holds size bytes of payload
+static inline size_t buddy_order_of(size_t size) {
+  return MAX(32 - __builtin_clz(size + WSIZE - 1), BUDDY_MIN_ORDER);
+}
 
-  // Search the free block list for a fit
-  if ((bp = find_best(asize)) != NULL) {
-    place(bp, asize);
-    return bp;
-  }
+// Read order of buddy block from its header
+static inline size_t buddy_order(void *bp) {
+  return (GET(HDRP(bp)) >> 3) & 0x1f;
+}
 
-  // Set last block previous alloc value to epilogue's prev alloc
-  last_prev_alloc = GET_PREV_ALLOC(HDRP(epilogue_pointer));
+// Read position of buddy block in its arena from its header
+static inline size_t buddy_pos(void *bp) {
+  return GET(HDRP(bp)) >> 8;
+}
 
-  // No fit found. Get more memory and place the block
-  size_t extendsize = get_extendsize(asize);
-  if ((bp = extend_heap(extendsize)) == NULL)
-    return NULL;
-  place(bp, asize);
-  return bp;
+// Given block ptr compute address of its arena
+static inline buddy_arena_t *buddy_arena(void *bp) {
+  return (void *)HDRP(bp) - buddy_pos(bp) - BUDDY_AREA_OFFSET;
 }
 
-// free - make block available for next allocations
-void free(void *bp) {
-  if (bp == NULL)
-    return;
+// Given arena and position compute block ptr
+static inline void *buddy_blkp(buddy_arena_t *arena, size_t pos) {
+  return (void *)arena + BUDDY_AREA_OFFSET + pos + WSIZE;
+}
 
-  size_t size = GET_SIZE(HDRP(bp));
-  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+// Make a buddy block
+static inline void make_buddy_block(void *bp, size_t order, size_t pos,
+                                    size_t alloc) {
+  PUT(HDRP(bp), (pos << 8) | (order << 3) | BUDDY | alloc);
+}
 
-  // Make the block free
-  make_free_block(bp, size, prev_alloc);
+// Check if a free block starts at given position in arena
+static inline bool buddy_map_test(buddy_arena_t *arena, size_t pos) {
+  size_t bit = pos >> BUDDY_MIN_ORDER;
+  return (arena->map[bit / 64] >> (bit % 64)) & 1;
+}
 
-  // Check for merge with adjacent blocks
-  coalesce(bp);
+// Put free buddy block on list of its order and mark it in the bitmap
+static void buddy_push(void *bp, size_t order) {
+  buddy_arena_t *arena = buddy_arena(bp);
+  size_t bit = buddy_pos(bp) >> BUDDY_MIN_ORDER;
+  unsigned int *head = &buddy_lists[order - BUDDY_MIN_ORDER];
+
+  arena->map[bit / 64] |= (uint64_t)1 << (bit % 64);
+  PUT(NEXT_P(bp), *head);
+  PUT(PREV_P(bp), 0);
+  if (*head)
+    PUT(PREV_P(buddy_ptr(*head)), buddy_off(bp));
+  *head = buddy_off(bp);
 }
 
-// realloc - Change the size of an allocated block
-void *realloc(void *old_ptr, size_t size) {
+// Take free buddy block off list of its order and clear it in the bitmap
+static void buddy_unlink(void *bp, size_t order) {
+  buddy_arena_t *arena = buddy_arena(bp);
+  size_t bit = buddy_pos(bp) >> BUDDY_MIN_ORDER;
+  unsigned int next = GET(NEXT_P(bp));
+  unsigned int prev = GET(PREV_P(bp));
 
-  // If new size is 0 - just free block
-  if (size == 0) {
-    free(old_ptr);
-    return NULL;
-  }
+  arena->map[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+  if (prev)
+    PUT(NEXT_P(buddy_ptr(prev)), next);
+  else
+    buddy_lists[order - BUDDY_MIN_ORDER] = next;
+  if (next)
+    PUT(PREV_P(buddy_ptr(next)), prev);
+}
 
-  // If old_ptr is NULL, then this is just malloc
-  if (!old_ptr) {
-    return malloc(size);
-  }
+// Take a new arena from the heap and fill it with largest free blocks
+static bool buddy_arena_create(void) {
+  buddy_arena_t *arena = malloc(BUDDY_AREA_OFFSET + BUDDY_AREA);
 
-  // Adjust block size to include overhead and alignment reqs
-  size_t asize = get_adjusted_size(size);
-  size_t old_size = GET_SIZE(HDRP(old_ptr));
+  if (arena == NULL)
+    return false;
 
-  // If old_size is much bigger than current size we make a split
-  if (old_size >= ALIGNMENT + asize) {
-    size_t prev_alloc = GET_PREV_ALLOC(HDRP(old_ptr));
-    make_allocated_block(old_ptr, asize, prev_alloc);
-    char *bp = NEXT_BLKP(old_ptr);
-    make_free_block(bp, old_size - asize, ALLOCATED);
-    coalesce(bp);
-    return old_ptr;
-  }
+  memset(arena, 0, sizeof(buddy_arena_t));
+  arena->next = buddy_arenas;
+  buddy_arenas = buddy_off(arena);
 
-  // If old_size is slightly bigger than current size we do nothing
-  if (old_size >= asize) {
-    return old_ptr;
+  for (size_t pos = 0; pos < BUDDY_AREA; pos += 1 << BUDDY_MAX_ORDER) {
+    void *bp = buddy_blkp(arena, pos);
+    make_buddy_block(bp, BUDDY_MAX_ORDER, pos, FREE);
+    buddy_push(bp, BUDDY_MAX_ORDER);
+  }
+
+  return true;
+}
+
+// Give an empty arena back to the heap, unless it is the only one
+static void buddy_arena_release(buddy_arena_t *arena) {
+  unsigned int *linkp = &buddy_arenas;
+
+  if (buddy_arenas == buddy_off(arena) && arena->next == 0)
+    return;
+
+  for (size_t pos = 0; pos < BUDDY_AREA; pos += 1 << BUDDY_MAX_ORDER)
+    buddy_unlink(buddy_blkp(arena, pos), BUDDY_MAX_ORDER);
+
+  while (*linkp != buddy_off(arena))
+    linkp = &((buddy_arena_t *)buddy_ptr(*linkp))->next;
+  *linkp = arena->next;
+
+  free(arena);
+}
+
+// Split free block down to given order, upper halves become free blocks
+static void buddy_split(void *bp, size_t order, size_t new_order) {
+  size_t pos = buddy_pos(bp);
+
+  while (order > new_order) {
+    order--;
+    void *half = bp + (1 << order);
+    make_buddy_block(half, order, pos + (1 << order), FREE);
+    buddy_push(half, order);
+  }
+}
+
+// Allocate a block from the smallest free buddy block that holds it
+static void *buddy_malloc(size_t size) {
+  size_t order = buddy_order_of(size);
+  size_t k = order;
+
+  TRACE_PATH(MM_PATH_BUDDY);
+
+  while (k <= BUDDY_MAX_ORDER && !buddy_lists[k - BUDDY_MIN_ORDER])
+    k++;
+
+  if (k > BUDDY_MAX_ORDER) {
+    if (!buddy_arena_create())
+      return NULL;
+    k = BUDDY_MAX_ORDER;
+  }
+
+  void *bp = buddy_ptr(buddy_lists[k - BUDDY_MIN_ORDER]);
+  buddy_unlink(bp, k);
+  buddy_split(bp, k, order);
+  make_buddy_block(bp, order, buddy_pos(bp), ALLOCATED);
+  buddy_arena(bp)->used++;
+  return bp;
+}
+
+// Free buddy block merging it with its free buddies
+static void buddy_free(void *bp) {
+  TRACE_PATH(MM_PATH_BUDDY);
+  buddy_arena_t *arena = buddy_arena(bp);
+  size_t order = buddy_order(bp);
+  size_t pos = buddy_pos(bp);
+
+  while (order < BUDDY_MAX_ORDER) {
+    size_t bpos = pos ^ (1 << order);
+    if (!buddy_map_test(arena, bpos))
+      break;
+    void *buddy = buddy_blkp(arena, bpos);
+    if (buddy_order(buddy) != order)
+      break;
+    buddy_unlink(buddy, order);
+    pos &= ~(1 << order);
+    order++;
+  }
+
+  bp = buddy_blkp(arena, pos);
+  make_buddy_block(bp, order, pos, FREE);
+  buddy_push(bp, order);
+
+  if (--arena->used == 0)
+    buddy_arena_release(arena);
+}
+
+// Change size of a buddy block, in place if it does not grow
+static void *buddy_realloc(void *old_ptr, size_t size) {
+  size_t order = buddy_order(old_ptr);
+
+  if (BUDDY_SERVES(size) && buddy_order_of(size) <= order) {
+    size_t new_order = buddy_order_of(size);
+    buddy_split(old_ptr, order, new_order);
+    make_buddy_block(old_ptr, new_order, buddy_pos(old_ptr), ALLOCATED);
+    stats()->realloc_in_place++;
+    return old_ptr;
+  }
+
+  void *new_ptr = malloc(size);
+
+  // If malloc fails, the original block is left untouched
+  if (!new_ptr)
+    return NULL;
+
+  stats()->realloc_copies++;
+  TRACE_PATH(MM_PATH_COPY);
+  memcpy(new_ptr, old_ptr, MIN((1 << order) - WSIZE, size));
+  buddy_free(old_ptr);
+  return new_ptr;
+}
+#endif
+
+/* Roots kept in the header of a persistent heap (see mem_open). Pointers
+ * are stored as offsets from the start of the heap. Everything else is
+ * derived from the heap itself when it is opened again. */
+#define MM_ROOTS_MAGIC 0x53544f4f52 /* "ROOTS" */
+
+typedef struct {
+  uint64_t magic;             /* MM_ROOTS_MAGIC while at a checkpoint */
+  uint64_t user[MM_ROOTS];    /* User roots, zero stands for NULL */
+#if BUDDY_TIER
+  unsigned int buddy_arenas;  /* Copy of buddy tier state */
+  unsigned int buddy_lists[BUDDY_ORDERS];
+#endif
+} mm_roots_t;
+
+_Static_assert(sizeof(mm_roots_t) <= MEM_ROOTS_SIZE,
+               "allocator roots do not fit in the heap header");
+
+/* Heap in a file is consistent only at a checkpoint, which the roots magic
+ * marks. mm_checkpoint sets it once the heap is written back, and the
+ * first change after that clears it in the file before the heap is
+ * touched, so mm_open refuses a heap left behind in the middle of a
+ * change. */
+static bool heap_clean; /* Heap is unchanged since the last checkpoint */
+
+static unsigned long heap_generation; /* Bumped by mm_init and mm_open */
+
+// Clear roots magic in the file before the heap changes
+static void heap_dirty(void) {
+  mm_roots_t *roots = mem_roots();
+  roots->magic = 0;
+  mem_sync_meta();
+  heap_clean = false;
+}
+
+// Called before anything in the heap changes
+static inline void heap_change(void) {
+  if (__builtin_expect(heap_clean, 0))
+    heap_dirty();
+}
+
+// mm_init - Called when a new trace starts.
+int mm_init(void) {
+  heap_generation++;
+  heap_dirty();
+  stats_reset();
+#if TRACEPOINTS
+  trace_head = 0;
+#endif
+  last_prev_alloc = 1;
+  sentinel_pointer = mem_heap_lo() + 2 * WSIZE;
+#if PLACEMENT == NEXT_FIT
+  rover = sentinel_pointer;
+#endif
+#if !SIZE_INDEX
+  trim_next = NULL;
+#endif
+#if SIZE_INDEX
+  if (size_index_init() < 0)
+    return -1;
+#endif
+#if BUDDY_TIER
+  buddy_arenas = 0;
+  memset(buddy_lists, 0, sizeof(buddy_lists));
+#endif
+  memset(line_pools, 0, sizeof(line_pools));
+
+  if ((heap_listp = mem_sbrk(2 * ALIGNMENT)) == (void *)-1)
+    return -1;
+
+  PUT(heap_listp, 0);                                     // Alignment padding
+  make_sentinel_block(heap_listp + 2 * WSIZE);            // Sentinel block
+  make_prologue_block(heap_listp + 6 * WSIZE);            // Prologue header
+  make_epilogue_block(heap_listp + 8 * WSIZE, ALLOCATED); // Epilogue header
+
+  heap_listp += (6 * WSIZE);
+
+  // Extend the empty heap with a free block of CHUNKSIZE bytes
+  if (extend_heap(CHUNKSIZE / WSIZE) == NULL)
+    return -1;
+
+  return 0;
+}
+
+// mm_set_root - Remember pointer into the heap under given number
+void mm_set_root(int i, void *ptr) {
+  mm_roots_t *roots = mem_roots();
+  heap_change();
+  roots->user[i] = ptr ? (char *)ptr - (char *)mem_heap_lo() : 0;
+}
+
+// mm_get_root - Get pointer remembered under given number
+void *mm_get_root(int i) {
+  mm_roots_t *roots = mem_roots();
+  return roots->user[i] ? (char *)mem_heap_lo() + roots->user[i] : NULL;
+}
+
+// mm_checkpoint - Save roots and write the heap back to its file
+int mm_checkpoint(void) {
+  mm_roots_t *roots = mem_roots();
+
+#if BUDDY_TIER
+  roots->buddy_arenas = buddy_arenas;
+  memcpy(roots->buddy_lists, buddy_lists, sizeof(buddy_lists));
+#endif
+
+  // Heap must be in the file before the magic says so
+  if (mem_sync() < 0)
+    return -1;
+  roots->magic = MM_ROOTS_MAGIC;
+  if (mem_sync_meta() < 0)
+    return -1;
+  heap_clean = true;
+  return 0;
+}
+
+// mm_open - Restore allocator state of a heap reopened with mem_open, the
+// heap is unmapped again if it is not consistent
+int mm_open(void) {
+  mm_roots_t *roots = mem_roots();
+
+  // Heap must be left at a checkpoint
+  if (roots->magic != MM_ROOTS_MAGIC)
+    goto fail;
+
+  heap_generation++;
+
+  // Blocks at the start and at the end of heap are at fixed places
+  sentinel_pointer = mem_heap_lo() + 2 * WSIZE;
+  heap_listp = mem_heap_lo() + 6 * WSIZE;
+  epilogue_pointer = mem_heap_hi() + 1;
+  last_prev_alloc = GET_PREV_ALLOC(HDRP(epilogue_pointer));
+#if PLACEMENT == NEXT_FIT
+  rover = sentinel_pointer;
+#endif
+#if !SIZE_INDEX
+  trim_next = NULL;
+#endif
+#if BUDDY_TIER
+  buddy_arenas = roots->buddy_arenas;
+  memcpy(buddy_lists, roots->buddy_lists, sizeof(buddy_lists));
+#endif
+
+#if SIZE_INDEX
+  if (size_index_init() < 0)
+    goto fail;
+#endif
+
+  // Size index and statistics live outside of the heap, so they are
+  // built again from free blocks
+  stats_reset();
+  void *bp = NEXT_BLKP(heap_listp);
+  for (size_t size; (size = GET_SIZE(HDRP(bp))) > 0; bp = NEXT_BLKP(bp)) {
+    // Walk must not leave the heap, even if a header is damaged
+    if (size % ALIGNMENT != 0 || (char *)bp + size > (char *)epilogue_pointer)
+      goto fail;
+    if (GET_ALLOC(HDRP(bp)) == FREE) {
+#if SIZE_INDEX
+      size_index_add(bp);
+#endif
+      stats_free_block(bp, 1);
+    }
+  }
+  if (bp != epilogue_pointer || mm_verify() < 0)
+    goto fail;
+
+  heap_clean = true;
+  return 0;
+
+fail:
+  mem_deinit();
+  return -1;
+}
+
+// mm_generation - Tell heaps apart, see mm.h
+unsigned long mm_generation(void) {
+  return heap_generation;
+}
+
+// malloc - Allocate a block of a given size
+void *TRACED(malloc)(size_t size) {
+  char *bp;
+
+  // Ignore spurious requests
+  if (size == 0)
+    return NULL;
+
+  heap_change();
+  stats_counters_t *c = stats();
+  c->mallocs++;
+  c->malloc_hist[stats_class(size)]++;
+
+#if BUDDY_TIER
+  // Medium sized requests go to buddy tier
+  if (BUDDY_SERVES(size))
+    return buddy_malloc(size);
+#endif
+
+  // Adjust block size to include overhead and alignment reqs
+  size_t asize = get_adjusted_size(size);
+
+  // Search the free block list for a fit
+  if ((bp = find_fit(asize, ALIGNMENT)) != NULL) {
+    TRACE_PATH(MM_PATH_FIT);
+    place(bp, asize);
+    return bp;
+  }
+
+  // Set last block previous alloc value to epilogue's prev alloc
+  last_prev_alloc = GET_PREV_ALLOC(HDRP(epilogue_pointer));
+
+  // No fit found. Get more memory and place the block
+  size_t extendsize = get_extendsize(asize);
+  if ((bp = extend_heap(extendsize)) == NULL)
+    return NULL;
+  place(bp, asize);
+  return bp;
+}
+
+// memalign - Allocate a block with payload aligned to a given boundary
+void *TRACED(memalign)(size_t alignment, size_t size) {
+  char *bp;
+
+  // Alignment must be a power of two
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    return NULL;
+
+  // Every payload is already aligned to ALIGNMENT
+  if (alignment <= ALIGNMENT)
+    return malloc(size);
+
+  // Ignore spurious requests
+  if (size == 0)
+    return NULL;
+
+  heap_change();
+
+  // Adjust block size to include overhead and alignment reqs
+  size_t asize = get_adjusted_size(size);
+
+  // Search the free block list for a block with aligned fit
+  if ((bp = find_fit(asize, alignment)) != NULL) {
+    TRACE_PATH(MM_PATH_FIT);
+    return place_aligned(bp, asize, alignment);
+  }
+
+  // Set last block previous alloc value to epilogue's prev alloc
+  last_prev_alloc = GET_PREV_ALLOC(HDRP(epilogue_pointer));
+
+  // No fit found. Get enough memory to cover any leading gap
+  size_t extendsize = get_extendsize(asize + alignment);
+  if ((bp = extend_heap(extendsize)) == NULL)
+    return NULL;
+  return place_aligned(bp, asize, alignment);
+}
+
+// free - make block available for next allocations
+void TRACED(free)(void *bp) {
+  if (bp == NULL)
+    return;
+
+  heap_change();
+  stats()->frees++;
+
+#if BUDDY_TIER
+  if (GET(HDRP(bp)) & BUDDY) {
+    buddy_free(bp);
+    return;
+  }
+#endif
+
+  size_t size = GET_SIZE(HDRP(bp));
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+
+  // Make the block free
+  make_free_block(bp, size, prev_alloc);
+
+  // Check for merge with adjacent blocks
+  coalesce(bp);
+}
+
+// realloc - Change the size of an allocated block
+void *TRACED(realloc)(void *old_ptr, size_t size) {
+
+  // If new size is 0 - just free block
+  if (size == 0) {
+    free(old_ptr);
+    return NULL;
+  }
+
+  // If old_ptr is NULL, then this is just malloc
+  if (!old_ptr) {
+    return malloc(size);
+  }
+
+  heap_change();
+
+#if BUDDY_TIER
+  if (GET(HDRP(old_ptr)) & BUDDY)
+    return buddy_realloc(old_ptr, size);
+#endif
+
+  // Adjust block size to include overhead and alignment reqs
+  size_t asize = get_adjusted_size(size);
+  size_t old_size = GET_SIZE(HDRP(old_ptr));
+
+  // If old_size is much bigger than current size we make a split
+  if (old_size >= ALIGNMENT + asize) {
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(old_ptr));
+    make_allocated_block(old_ptr, asize, prev_alloc);
+    char *bp = NEXT_BLKP(old_ptr);
+    make_free_block(bp, old_size - asize, ALLOCATED);
+    coalesce(bp);
+    stats()->realloc_in_place++;
+    return old_ptr;
+  }
+
+  // If old_size is slightly bigger than current size we do nothing
+  if (old_size >= asize) {
+    stats()->realloc_in_place++;
+    return old_ptr;
   }
 
   // If our block is last block in heap we make extend_heap */
@@ -419,6 +1561,7 @@ void *realloc(void *old_ptr, size_t size) {
       char *bp = NEXT_BLKP(old_ptr);
       make_free_block(bp, old_size + next_size - asize, ALLOCATED);
       add_block_to_free_list(bp);
+      stats()->realloc_in_place++;
       return old_ptr;
     }
 
@@ -428,17 +1571,21 @@ void *realloc(void *old_ptr, size_t size) {
       remove_block_from_free_list(NEXT_BLKP(old_ptr));
       make_allocated_block(old_ptr, old_size + next_size, prev_alloc);
       set_prev_alloc(NEXT_BLKP(old_ptr), ALLOCATED);
+      stats()->realloc_in_place++;
       return old_ptr;
     }
   }
 
-  // Copy memory if necessary
-  void *new_ptr = malloc(size);
+  // Copy memory if necessary, block keeps growing so move it to the top
+  void *new_ptr = malloc_top(size);
 
   // If malloc fails, the original block is left untouched
   if (!new_ptr)
     return NULL;
 
+  stats()->realloc_copies++;
+  TRACE_PATH(MM_PATH_COPY);
+
   memcpy(new_ptr, old_ptr, old_size);
 
   // Free the old block
@@ -459,6 +1606,554 @@ void *calloc(size_t nmemb, size_t size) {
   return new_ptr;
 }
 
+// mm_usable_size - Get number of payload bytes an allocated block holds
+size_t mm_usable_size(void *ptr) {
+  if (ptr == NULL)
+    return 0;
+
+#if BUDDY_TIER
+  if (GET(HDRP(ptr)) & BUDDY)
+    return ((size_t)1 << buddy_order(ptr)) - WSIZE;
+#endif
+
+  // Allocated blocks have no footer, only the header is overhead
+  return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+#if TRACEPOINTS
+// malloc - Traced entry point of malloc_untraced
+void *malloc(size_t size) {
+  unsigned long start = trace_begin();
+  void *bp = malloc_untraced(size);
+  trace_end(start, MM_TRACE_MALLOC, size, bp);
+  return bp;
+}
+
+// memalign - Traced entry point of memalign_untraced
+void *memalign(size_t alignment, size_t size) {
+  unsigned long start = trace_begin();
+  void *bp = memalign_untraced(alignment, size);
+  trace_end(start, MM_TRACE_MEMALIGN, size, bp);
+  return bp;
+}
+
+// free - Traced entry point of free_untraced
+void free(void *bp) {
+  unsigned long start = trace_begin();
+  free_untraced(bp);
+  trace_end(start, MM_TRACE_FREE, 0, bp);
+}
+
+// realloc - Traced entry point of realloc_untraced
+void *realloc(void *old_ptr, size_t size) {
+  unsigned long start = trace_begin();
+  void *bp = realloc_untraced(old_ptr, size);
+  if (bp != NULL && bp == old_ptr)
+    TRACE_PATH(MM_PATH_IN_PLACE);
+  trace_end(start, MM_TRACE_REALLOC, size, bp);
+  return bp;
+}
+#endif
+
+// mm_trace_read - Copy up to max most recent traced calls, oldest first
+size_t mm_trace_read(mm_trace_event_t *events, size_t max) {
+#if TRACEPOINTS
+  unsigned long head = __atomic_load_n(&trace_head, __ATOMIC_RELAXED);
+  size_t n = MIN(MIN(head, TRACE_ENTRIES), max);
+
+  for (size_t i = 0; i < n; i++)
+    events[i] = trace_ring[(head - n + i) & (TRACE_ENTRIES - 1)];
+  return n;
+#else
+  return 0;
+#endif
+}
+
+/* Region bumps a pointer through chunks taken from the heap with malloc.
+ * First ALIGNMENT bytes of every chunk link it to the previous one, so
+ * destroying a region frees whole chunks without looking at objects. */
+struct mm_region {
+  void **chunk; /* Most recently taken chunk */
+  char *cur;    /* Next free byte of current chunk */
+  char *end;    /* End of current chunk */
+};
+
+// mm_region_create - Make an empty region
+mm_region_t *mm_region_create(void) {
+  mm_region_t *region = malloc(sizeof(mm_region_t));
+
+  if (region)
+    memset(region, 0, sizeof(mm_region_t));
+
+  return region;
+}
+
+// mm_region_alloc - Allocate a block that lives until region is destroyed
+void *mm_region_alloc(mm_region_t *region, size_t size) {
+  void *p;
+
+  // Ignore spurious requests
+  if (size == 0)
+    return NULL;
+
+  size = ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
+  heap_change();
+
+  // Bump allocation from current chunk
+  if (size <= (size_t)(region->end - region->cur)) {
+    p = region->cur;
+    region->cur += size;
+    return p;
+  }
+
+  size_t chunksize = MAX(size, REGION_CHUNKSIZE) + ALIGNMENT;
+  void **chunk = malloc(chunksize);
+
+  if (chunk == NULL)
+    return NULL;
+
+  p = (char *)chunk + ALIGNMENT;
+
+  // Big blocks get a chunk of their own, current chunk keeps its space
+  if (size > REGION_CHUNKSIZE / 4 && region->chunk) {
+    *chunk = *region->chunk;
+    *region->chunk = chunk;
+    return p;
+  }
+
+  *chunk = region->chunk;
+  region->chunk = chunk;
+  region->cur = p + size;
+  region->end = (char *)chunk + chunksize;
+  return p;
+}
+
+// mm_region_destroy - Free region with all blocks allocated from it
+void mm_region_destroy(mm_region_t *region) {
+  void **chunk = region->chunk;
+
+  while (chunk) {
+    void **prev = *chunk;
+    free(chunk);
+    chunk = prev;
+  }
+
+  free(region);
+}
+
+/* Pool hands out objects of one size from slabs taken from the heap with
+ * memalign(POOL_SLAB, POOL_SLAB_BYTES), so masking an object pointer gives
+ * its slab. Block of a slab, header word included, takes exactly POOL_SLAB
+ * bytes, so slabs lie next to each other with no gap in between. Every slab keeps an intrusive list of freed objects and a bump
+ * pointer into the part that was never used, so a new slab needs no setup.
+ * Slabs with free objects are on a list of their own, which makes both
+ * alloc and free O(1). Slab that becomes empty is given back to the heap,
+ * unless it is the only one with free objects. */
+#define POOL_SLAB_BYTES (POOL_SLAB - WSIZE)
+
+typedef struct pool_slab {
+  struct pool_slab *next; /* Next slab on the same list */
+  struct pool_slab *prev; /* Previous slab on the same list */
+  void *free;             /* Intrusive list of freed objects */
+  char *bump;             /* First object that was never used */
+  struct mm_pool *pool;   /* Pool that owns slab */
+  unsigned int used;      /* Objects handed out from slab */
+} pool_slab_t;
+
+struct mm_pool {
+  pool_slab_t *partial; /* Slabs with free objects */
+  pool_slab_t *full;    /* Slabs without free objects */
+  size_t objsize;       /* Size of object rounded up to its alignment */
+  size_t first;         /* Offset of first object in a slab */
+  size_t slabs;         /* Slabs taken from the heap */
+  size_t used;          /* Objects handed out from slabs */
+  unsigned int id;      /* Unique, picks a way of thread-local cache */
+};
+
+#if POOL_CACHE
+/* Way is matched by pool id, not pointer, since a pool created after
+ * another one was destroyed may get the same address. */
+typedef struct {
+  unsigned int id;
+  unsigned int count;
+  void *objs[POOL_CACHE_SIZE];
+} pool_cache_t;
+
+static __thread pool_cache_t pool_cache[POOL_CACHE_WAYS];
+#endif
+
+static unsigned int pool_ids;
+
+// Given object ptr compute address of its slab
+static inline pool_slab_t *pool_slab(void *p) {
+  return (pool_slab_t *)((uintptr_t)p & ~(uintptr_t)(POOL_SLAB - 1));
+}
+
+// Put slab at the front of a list
+static inline void pool_link(pool_slab_t **list, pool_slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+// Take slab off a list
+static inline void pool_unlink(pool_slab_t **list, pool_slab_t *slab) {
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+}
+
+// mm_pool_create - Make a pool of objects of given size and alignment
+mm_pool_t *mm_pool_create(size_t size, size_t alignment) {
+  // Alignment must be a power of two
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    return NULL;
+
+  // Freed objects hold a link to the next one
+  alignment = MAX(alignment, sizeof(void *));
+  size = MAX(size, sizeof(void *));
+
+  size_t objsize = (size + alignment - 1) & ~(alignment - 1);
+  size_t first = (sizeof(pool_slab_t) + alignment - 1) & ~(alignment - 1);
+
+  // Slab must hold at least one object
+  if (first + objsize > POOL_SLAB_BYTES)
+    return NULL;
+
+  mm_pool_t *pool = malloc(sizeof(mm_pool_t));
+
+  if (pool == NULL)
+    return NULL;
+
+  memset(pool, 0, sizeof(mm_pool_t));
+  pool->objsize = objsize;
+  pool->first = first;
+  pool->id = __atomic_fetch_add(&pool_ids, 1, __ATOMIC_RELAXED);
+  return pool;
+}
+
+// mm_pool_alloc - Allocate an object from pool
+void *mm_pool_alloc(mm_pool_t *pool) {
+  void *p;
+
+  heap_change();
+
+#if POOL_CACHE
+  pool_cache_t *cache = &pool_cache[pool->id % POOL_CACHE_WAYS];
+  if (cache->id == pool->id && cache->count > 0)
+    return cache->objs[--cache->count];
+#endif
+
+  pool_slab_t *slab = pool->partial;
+
+  // Take a new slab from the heap
+  if (slab == NULL) {
+    if ((slab = memalign(POOL_SLAB, POOL_SLAB_BYTES)) == NULL)
+      return NULL;
+    slab->free = NULL;
+    slab->bump = (char *)slab + pool->first;
+    slab->pool = pool;
+    slab->used = 0;
+    pool_link(&pool->partial, slab);
+    pool->slabs++;
+  }
+
+  if (slab->free) {
+    p = slab->free;
+    slab->free = *(void **)p;
+  } else {
+    p = slab->bump;
+    slab->bump += pool->objsize;
+  }
+
+  slab->used++;
+  pool->used++;
+
+  // Move slab out of the way once it has no free objects
+  if (slab->free == NULL &&
+      slab->bump + pool->objsize > (char *)slab + POOL_SLAB_BYTES) {
+    pool_unlink(&pool->partial, slab);
+    pool_link(&pool->full, slab);
+  }
+
+  return p;
+}
+
+// mm_pool_free - Give object back to its pool
+void mm_pool_free(mm_pool_t *pool, void *p) {
+  if (p == NULL)
+    return;
+
+  heap_change();
+
+#if POOL_CACHE
+  pool_cache_t *cache = &pool_cache[pool->id % POOL_CACHE_WAYS];
+  if (cache->count == 0)
+    cache->id = pool->id;
+  if (cache->id == pool->id && cache->count < POOL_CACHE_SIZE) {
+    cache->objs[cache->count++] = p;
+    return;
+  }
+#endif
+
+  pool_slab_t *slab = pool_slab(p);
+
+  // Slab without free objects gets one now
+  if (slab->free == NULL &&
+      slab->bump + pool->objsize > (char *)slab + POOL_SLAB_BYTES) {
+    pool_unlink(&pool->full, slab);
+    pool_link(&pool->partial, slab);
+  }
+
+  *(void **)p = slab->free;
+  slab->free = p;
+  slab->used--;
+  pool->used--;
+
+  // Give empty slab back to the heap, unless it is the only partial one
+  if (slab->used == 0 && (slab->prev || slab->next)) {
+    pool_unlink(&pool->partial, slab);
+    pool->slabs--;
+    free(slab);
+  }
+}
+
+// mm_pool_stats - Report occupancy of pool
+void mm_pool_stats(mm_pool_t *pool, mm_pool_stats_t *stats) {
+  stats->objsize = pool->objsize;
+  stats->slabs = pool->slabs;
+  stats->capacity =
+    pool->slabs * ((POOL_SLAB_BYTES - pool->first) / pool->objsize);
+  stats->used = pool->used;
+  stats->cached = 0;
+
+#if POOL_CACHE
+  pool_cache_t *cache = &pool_cache[pool->id % POOL_CACHE_WAYS];
+  if (cache->id == pool->id)
+    stats->cached = cache->count;
+#endif
+}
+
+// mm_pool_destroy - Free pool with all its slabs
+void mm_pool_destroy(mm_pool_t *pool) {
+#if POOL_CACHE
+  // Objects cached by other threads are lost with their slabs. Ids are
+  // never reused, so no other pool is handed them out again
+  pool_cache_t *cache = &pool_cache[pool->id % POOL_CACHE_WAYS];
+  if (cache->id == pool->id)
+    cache->count = 0;
+#endif
+
+  pool_slab_t *lists[] = {pool->partial, pool->full};
+
+  for (int i = 0; i < 2; i++) {
+    pool_slab_t *slab = lists[i];
+    while (slab) {
+      pool_slab_t *next = slab->next;
+      free(slab);
+      slab = next;
+    }
+  }
+
+  free(pool);
+}
+
+/* Isolated blocks start at a cache line and are padded to whole lines, so
+ * data of two blocks never shares a line. Up to LINE_CLASSES lines they
+ * come from one pool per number of lines, so padding stays out of the
+ * general heap. Bigger ones get a page aligned block with a slab header
+ * of their own, whose pool is NULL, sized to whole slabs like the blocks
+ * of pools. Either way masking a block pointer
+ * with POOL_SLAB gives a header that tells how to free it. */
+#define LINE_OFFSET                                                            \
+  (CACHE_LINE * ((sizeof(pool_slab_t) + CACHE_LINE - 1) / CACHE_LINE))
+
+// mm_malloc_isolated - Allocate a block that owns whole cache lines
+void *mm_malloc_isolated(size_t size) {
+  // Ignore spurious requests
+  if (size == 0)
+    return NULL;
+
+  size_t lines = (size + CACHE_LINE - 1) / CACHE_LINE;
+
+  if (lines <= LINE_CLASSES) {
+    mm_pool_t **pool = &line_pools[lines - 1];
+    if (*pool == NULL && !(*pool = mm_pool_create(lines * CACHE_LINE,
+                                                  CACHE_LINE)))
+      return NULL;
+    return mm_pool_alloc(*pool);
+  }
+
+  size_t slabs = (LINE_OFFSET + lines * CACHE_LINE + WSIZE + POOL_SLAB - 1) /
+                 POOL_SLAB;
+  pool_slab_t *slab = memalign(POOL_SLAB, slabs * POOL_SLAB - WSIZE);
+
+  if (slab == NULL)
+    return NULL;
+
+  slab->pool = NULL;
+  return (char *)slab + LINE_OFFSET;
+}
+
+// mm_free_isolated - Free a block allocated with mm_malloc_isolated
+void mm_free_isolated(void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  pool_slab_t *slab = pool_slab(ptr);
+
+  if (slab->pool)
+    mm_pool_free(slab->pool, ptr);
+  else
+    free(slab);
+}
+
+// Count bytes of pages in [lo, hi) that are backed by memory
+static size_t resident_bytes(uintptr_t lo, uintptr_t hi) {
+  size_t base = getpagesize();
+  unsigned char vec[4096];
+  size_t bytes = 0;
+
+  for (uintptr_t p = lo; p < hi; p += sizeof(vec) * base) {
+    size_t len = MIN(hi - p, sizeof(vec) * base);
+    if (mincore((void *)p, len, vec) < 0)
+      return hi - lo;
+    for (size_t i = 0; i < (len + base - 1) / base; i++)
+      bytes += (vec[i] & 1) * base;
+  }
+
+  return bytes;
+}
+
+// Give pages inside a free block back to the OS, keeping tags and links.
+// Only pages still backed by memory are counted, so pages given back by
+// an earlier call are not counted again.
+static size_t trim_block(void *bp, size_t page) {
+  uintptr_t lo = ((uintptr_t)bp + DSIZE + page - 1) & ~(page - 1);
+  uintptr_t hi = (uintptr_t)FTRP(bp) & ~(page - 1);
+
+  if (hi <= lo)
+    return 0;
+
+  size_t resident = resident_bytes(lo, hi);
+  if (resident == 0 || madvise((void *)lo, hi - lo, MADV_DONTNEED) < 0)
+    return 0;
+  return resident;
+}
+
+#if SIZE_INDEX
+static int trim_cursor; /* Size index entry where next mm_trim starts */
+#endif
+
+// mm_trim - Give back pages inside free blocks of at least min_size bytes,
+// looking at up to max_blocks blocks, and return bytes given back. Every
+// call goes on where the previous one stopped, and stops where a pass
+// over all free blocks ends.
+size_t mm_trim(size_t min_size, size_t max_blocks) {
+  size_t page = mem_pagesize();
+  size_t released = 0;
+
+#if SIZE_INDEX
+  if (trim_cursor >= free_count)
+    trim_cursor = 0;
+
+  // Wilderness is not indexed, it is looked at when a pass starts
+  if (trim_cursor == 0 && free_top && GET_SIZE(HDRP(free_top)) >= min_size)
+    released += trim_block(free_top, page);
+
+  for (size_t n = 0; n < max_blocks && trim_cursor < free_count; n++) {
+    int i = trim_cursor++;
+    if (free_sizes[i] >= min_size)
+      released += trim_block(mem_heap_lo() + free_offs[i], page);
+  }
+#else
+  if (trim_next == NULL || trim_next == sentinel_pointer)
+    trim_next = get_next_free_blkp(sentinel_pointer);
+
+  for (size_t n = 0; n < max_blocks && trim_next != sentinel_pointer; n++) {
+    if (GET_SIZE(HDRP(trim_next)) >= min_size)
+      released += trim_block(trim_next, page);
+    trim_next = get_next_free_blkp(trim_next);
+  }
+#endif
+
+  return released;
+}
+
+// mm_stats - Take a snapshot of allocator statistics
+void mm_stats(mm_stats_t *snapshot) {
+  stats_counters_t sum;
+
+#if THREADS
+  long *dst = (long *)&sum;
+
+  pthread_mutex_lock(&stats_lock);
+  memcpy(&sum, &stats_retired, STATS_FIELDS);
+  for (stats_counters_t *c = stats_threads; c; c = c->next) {
+    long *src = (long *)c;
+    for (size_t i = 0; i < STATS_FIELDS / sizeof(long); i++)
+      dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&stats_lock);
+#else
+  memcpy(&sum, &global_stats, STATS_FIELDS);
+#endif
+
+  // Padding, sentinel, prologue and epilogue are not part of any block
+  snapshot->heap_size = mem_heapsize();
+  snapshot->free_bytes = sum.free_bytes;
+  snapshot->allocated_bytes =
+    snapshot->heap_size ? snapshot->heap_size - 2 * ALIGNMENT - sum.free_bytes
+                        : 0;
+  snapshot->free_blocks = sum.free_blocks;
+  snapshot->extensions = sum.extensions;
+  snapshot->mallocs = sum.mallocs;
+  snapshot->frees = sum.frees;
+  snapshot->reallocs_in_place = sum.realloc_in_place;
+  snapshot->reallocs_copied = sum.realloc_copies;
+  for (int i = 0; i < MM_STATS_CLASSES; i++) {
+    snapshot->malloc_hist[i] = sum.malloc_hist[i];
+    snapshot->free_hist[i] = sum.free_hist[i];
+  }
+}
+
+#if BUDDY_TIER
+// Report blocks of arena at bp, if bp is one, and return true
+static bool buddy_walk(void *bp, mm_walk_fn_t *fn, void *arg) {
+  buddy_arena_t *arena = buddy_ptr(buddy_arenas);
+
+  while (arena != NULL && (void *)arena != bp)
+    arena = buddy_ptr(arena->next);
+  if (arena == NULL)
+    return false;
+
+  for (size_t pos = 0; pos < BUDDY_AREA; pos += 1 << buddy_order(bp)) {
+    bp = buddy_blkp(arena, pos);
+    fn(arg, HDRP(bp), 1 << buddy_order(bp), GET_ALLOC(HDRP(bp)));
+  }
+  return true;
+}
+#endif
+
+// mm_heap_walk - Call fn on every block in address order, following
+// boundary tags. Buddy arenas are reported as the blocks they hold.
+void mm_heap_walk(mm_walk_fn_t *fn, void *arg) {
+  // Prologue is not a block of the program
+  for (void *bp = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(bp)) > 0;
+       bp = NEXT_BLKP(bp)) {
+#if BUDDY_TIER
+    if (GET_ALLOC(HDRP(bp)) && buddy_walk(bp, fn, arg))
+      continue;
+#endif
+    fn(arg, HDRP(bp), GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp)));
+  }
+}
+
 // Print all blocks in heap
 static void printf_heap(char *message) {
   printf("printf HEAP: %s!\n", message);
@@ -509,56 +2204,190 @@ static void printf_heap(char *message) {
   return;
 }
 
-// mm_checkheap - Check heap consistency
-void mm_checkheap(int verbose) {
-  if (verbose == 1)
-    printf_heap("Checkheap");
+/* A failed check aborts in mm_checkheap and makes mm_verify return -1 */
+#define HEAP_CHECK(cond)                                                       \
+  do {                                                                         \
+    if (fatal)                                                                 \
+      assert(cond);                                                            \
+    if (!(cond))                                                               \
+      return -1;                                                               \
+  } while (0)
+
+// Check that a free list link points at a block inside the heap
+static inline bool in_heap_blocks(void *bp) {
+  return (char *)bp >= (char *)sentinel_pointer &&
+         (char *)bp < (char *)epilogue_pointer;
+}
 
+// check_heap - Check heap consistency, never reading outside the heap
+static int check_heap(bool fatal) {
   void *bp;
   int i = 0;
+  int free_blocks = 0;
+  size_t free_bytes = 0;
 
-  size_t old_hd_alloc;
+  size_t old_hd_alloc = ALLOCATED;
 
   // We iterate through heap with boundary tags
   for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+    size_t hd_size = GET_SIZE(HDRP(bp));
     size_t hd_alloc = GET_ALLOC(HDRP(bp));
     size_t hd_prev_alloc = GET_PREV_ALLOC(HDRP(bp));
 
-    size_t ft_alloc = GET_ALLOC(FTRP(bp));
-    size_t ft_prev_alloc = GET_PREV_ALLOC(FTRP(bp));
-
-    // Check header and footer equality
-    if (hd_alloc == FREE) {
-      assert(hd_alloc == ft_alloc);
-      assert(hd_prev_alloc == ft_prev_alloc);
-    }
+    // Check that block lies within the heap
+    HEAP_CHECK((char *)bp + hd_size <= (char *)epilogue_pointer);
 
     if (bp != heap_listp) {
+      // Check that payload is aligned and block size keeps it that way
+      HEAP_CHECK(((uintptr_t)bp % ALIGNMENT) == 0);
+      HEAP_CHECK(hd_size % ALIGNMENT == 0 && hd_size >= ALIGNMENT);
+
       // Check that there are no two subsequent free blocks
-      assert(old_hd_alloc != FREE || hd_alloc != FREE);
+      HEAP_CHECK(old_hd_alloc != FREE || hd_alloc != FREE);
 
       // Check that prev_alloc field is same as previous block alloc field
-      assert(old_hd_alloc == hd_prev_alloc);
+      HEAP_CHECK(old_hd_alloc == hd_prev_alloc);
+    }
+
+    if (hd_alloc == FREE) {
+      // Check header and footer equality
+      HEAP_CHECK(hd_alloc == GET_ALLOC(FTRP(bp)));
+      HEAP_CHECK(hd_prev_alloc == GET_PREV_ALLOC(FTRP(bp)));
+
+      free_blocks++;
+      free_bytes += hd_size;
     }
 
     old_hd_alloc = hd_alloc;
     i++;
   }
 
+  // Check that we ended up at the epilogue
+  HEAP_CHECK(bp == epilogue_pointer);
+
+  // Check that statistics agree with the heap
+  mm_stats_t snapshot;
+  mm_stats(&snapshot);
+  HEAP_CHECK(snapshot.free_blocks == free_blocks);
+  HEAP_CHECK(snapshot.free_bytes == free_bytes);
+
+#if SIZE_INDEX
+  // Check that size index mirrors all free blocks except the wilderness
+  HEAP_CHECK(free_top == get_wilderness());
+  HEAP_CHECK(free_count == free_blocks - (free_top != NULL));
+  for (i = 0; i < free_count; i++) {
+    bp = (char *)mem_heap_lo() + free_offs[i];
+    HEAP_CHECK(GET_ALLOC(HDRP(bp)) == FREE);
+    HEAP_CHECK(GET_SIZE(HDRP(bp)) == free_sizes[i]);
+    HEAP_CHECK(free_slots[SIZE_INDEX_SLOT(free_offs[i])] == (unsigned int)i);
+  }
+#endif
+
   // We iterate through heap with free list pointers
+  HEAP_CHECK(in_heap_blocks(get_next_free_blkp(sentinel_pointer)));
   for (bp = get_next_free_blkp(sentinel_pointer); bp != sentinel_pointer;
        bp = get_next_free_blkp(bp)) {
     size_t hd_alloc = GET_ALLOC(HDRP(bp));
 
+    // Check that list has no more blocks than the heap, so it is no cycle
+    HEAP_CHECK(free_blocks > 0);
+
     // Check if block is free
-    assert(hd_alloc == FREE);
+    HEAP_CHECK(hd_alloc == FREE);
 
-    // Check if block points to free blocks
-    assert(GET_ALLOC(HDRP(get_next_free_blkp(bp))) == FREE);
-    assert(GET_ALLOC(HDRP(get_prev_free_blkp(bp))) == FREE);
+    // Check if block points to free blocks inside the heap
+    HEAP_CHECK(in_heap_blocks(get_next_free_blkp(bp)));
+    HEAP_CHECK(in_heap_blocks(get_prev_free_blkp(bp)));
+    HEAP_CHECK(GET_ALLOC(HDRP(get_next_free_blkp(bp))) == FREE);
+    HEAP_CHECK(GET_ALLOC(HDRP(get_prev_free_blkp(bp))) == FREE);
 
     // Check if blocks points to each other
-    assert(get_next_free_blkp(get_prev_free_blkp(bp)) == bp);
-    assert(get_prev_free_blkp(get_next_free_blkp(bp)) == bp);
+    HEAP_CHECK(get_next_free_blkp(get_prev_free_blkp(bp)) == bp);
+    HEAP_CHECK(get_prev_free_blkp(get_next_free_blkp(bp)) == bp);
+
+    free_blocks--;
+  }
+
+  // Check that every free block (e.g. split off by memalign) is on the list
+  HEAP_CHECK(free_blocks == 0);
+
+#if BUDDY_TIER
+  int buddy_free_blocks = 0;
+  size_t arenas = 0;
+
+  // We iterate through buddy blocks of every arena
+  for (buddy_arena_t *arena = buddy_ptr(buddy_arenas); arena != NULL;
+       arena = buddy_ptr(arena->next)) {
+    unsigned int used = 0;
+
+    // Arena is an allocated block of the heap, arenas do not form a cycle
+    HEAP_CHECK(in_heap_blocks(arena) &&
+               (char *)buddy_blkp(arena, BUDDY_AREA) <=
+                   (char *)epilogue_pointer);
+    HEAP_CHECK(GET_ALLOC(HDRP(arena)) == ALLOCATED);
+    HEAP_CHECK(++arenas <= mem_heapsize() / BUDDY_AREA);
+
+    for (size_t pos = 0; pos < BUDDY_AREA; pos += 1 << buddy_order(bp)) {
+      bp = buddy_blkp(arena, pos);
+      size_t order = buddy_order(bp);
+
+      // Check block flag, stored position, order and alignment
+      HEAP_CHECK(GET(HDRP(bp)) & BUDDY);
+      HEAP_CHECK(buddy_pos(bp) == pos);
+      HEAP_CHECK(order >= BUDDY_MIN_ORDER && order <= BUDDY_MAX_ORDER);
+      HEAP_CHECK(pos % (1 << order) == 0);
+      HEAP_CHECK(((uintptr_t)bp % ALIGNMENT) == 0);
+
+      // Check that bitmap marks exactly starts of free blocks
+      HEAP_CHECK(buddy_map_test(arena, pos) == !GET_ALLOC(HDRP(bp)));
+
+      if (GET_ALLOC(HDRP(bp))) {
+        used++;
+      } else {
+        // Check that free blocks were merged with their free buddies
+        size_t bpos = pos ^ (1 << order);
+        if (order < BUDDY_MAX_ORDER && buddy_map_test(arena, bpos))
+          HEAP_CHECK(buddy_order(buddy_blkp(arena, bpos)) != order);
+        buddy_free_blocks++;
+      }
+    }
+
+    HEAP_CHECK(used == arena->used);
+  }
+
+  // We iterate through free lists of every order
+  for (size_t order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++) {
+    unsigned int prev = 0;
+    for (bp = buddy_ptr(buddy_lists[order - BUDDY_MIN_ORDER]); bp != NULL;
+         bp = buddy_ptr(GET(NEXT_P(bp)))) {
+      // Check that block is inside the heap and lists have no cycle
+      HEAP_CHECK(in_heap_blocks(bp) && buddy_free_blocks > 0);
+
+      // Check that block is free, of right order and linked both ways
+      HEAP_CHECK((GET(HDRP(bp)) & (BUDDY | ALLOCATED)) == BUDDY);
+      HEAP_CHECK(buddy_order(bp) == order);
+      HEAP_CHECK(GET(PREV_P(bp)) == prev);
+      prev = buddy_off(bp);
+      buddy_free_blocks--;
+    }
   }
-}
\ No newline at end of file
+
+  // Check that every free buddy block is on a list
+  HEAP_CHECK(buddy_free_blocks == 0);
+#endif
+
+  return 0;
+}
+
+// mm_checkheap - Check heap consistency, abort if it is broken
+void mm_checkheap(int verbose) {
+  if (verbose == 1)
+    printf_heap("Checkheap");
+
+  check_heap(true);
+}
+
+// mm_verify - Check heap consistency, see mm.h
+int mm_verify(void) {
+  return check_heap(false);
+}
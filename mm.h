@@ -7,6 +7,7 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
 
 #else
 
@@ -15,11 +16,111 @@ extern void *malloc(size_t size);
 extern void free(void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
 
 #endif
 
 extern int mm_init(void);
 
+/* Payload bytes of an allocated block, at least as many as requested */
+extern size_t mm_usable_size(void *ptr);
+
+/* Number of heaps set up with mm_init or mm_open so far, changes when
+ * everything allocated before is gone */
+extern unsigned long mm_generation(void);
+
+/* Heap kept in a file is reopened with its allocator state and roots.
+ * mm_open fails, and unmaps the heap again, if it is not consistent. */
+#define MM_ROOTS 16
+
+extern int mm_open(void);
+extern int mm_checkpoint(void);
+extern void mm_set_root(int i, void *ptr);
+extern void *mm_get_root(int i);
+
+/* Regions hand out blocks that are all released together on destroy */
+typedef struct mm_region mm_region_t;
+
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *region, size_t size);
+extern void mm_region_destroy(mm_region_t *region);
+
+/* Pools hand out objects of one size and alignment in constant time */
+typedef struct mm_pool mm_pool_t;
+
+typedef struct {
+  size_t objsize;  /* Object size rounded up to alignment */
+  size_t slabs;    /* Slabs taken from the heap */
+  size_t capacity; /* Objects that fit in those slabs */
+  size_t used;     /* Objects handed out from slabs */
+  size_t cached;   /* Freed objects kept in this thread's cache */
+} mm_pool_stats_t;
+
+extern mm_pool_t *mm_pool_create(size_t size, size_t alignment);
+extern void *mm_pool_alloc(mm_pool_t *pool);
+extern void mm_pool_free(mm_pool_t *pool, void *ptr);
+extern void mm_pool_stats(mm_pool_t *pool, mm_pool_stats_t *stats);
+extern void mm_pool_destroy(mm_pool_t *pool);
+
+/* Snapshot of allocator statistics */
+#define MM_STATS_CLASSES 24 /* Class i holds sizes 16 << i up to twice that */
+
+typedef struct {
+  size_t heap_size;                     /* Bytes taken from memlib */
+  size_t allocated_bytes;               /* Bytes of allocated blocks */
+  size_t free_bytes;                    /* Bytes of free blocks */
+  size_t free_blocks;                   /* Number of free blocks */
+  size_t extensions;                    /* Times the heap was extended */
+  size_t mallocs;                       /* Calls to malloc */
+  size_t frees;                         /* Calls to free */
+  size_t reallocs_in_place;             /* Reallocs that kept the block */
+  size_t reallocs_copied;               /* Reallocs that moved the block */
+  size_t malloc_hist[MM_STATS_CLASSES]; /* Mallocs by requested size */
+  size_t free_hist[MM_STATS_CLASSES];   /* Free blocks by size */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
+
+/* Visit blocks in address order: start of header, bytes, allocated */
+typedef void mm_walk_fn_t(void *arg, void *block, size_t size, int allocated);
+
+extern void mm_heap_walk(mm_walk_fn_t *fn, void *arg);
+
+/* Give pages inside large free blocks back to the OS */
+extern size_t mm_trim(size_t min_size, size_t max_blocks);
+
+/* Calls recorded by tracepoints (mm.c built with -DTRACEPOINTS) */
+#define MM_TRACE_MALLOC 0
+#define MM_TRACE_FREE 1
+#define MM_TRACE_REALLOC 2
+#define MM_TRACE_MEMALIGN 3
+
+/* Bits of path taken by a traced call */
+#define MM_PATH_FIT 0x01      /* Free block found by search */
+#define MM_PATH_EXTEND 0x02   /* Heap was extended */
+#define MM_PATH_MERGE 0x04    /* Free block merged with neighbours */
+#define MM_PATH_BUDDY 0x08    /* Served by buddy tier */
+#define MM_PATH_IN_PLACE 0x10 /* Realloc kept the block */
+#define MM_PATH_COPY 0x20     /* Realloc moved the block */
+
+typedef struct {
+  unsigned long cycles; /* Cost of the call */
+  size_t size;          /* Requested size */
+  void *result;         /* Returned block, or freed one */
+  unsigned char op;     /* MM_TRACE_* */
+  unsigned char path;   /* MM_PATH_* bits */
+} mm_trace_event_t;
+
+extern size_t mm_trace_read(mm_trace_event_t *events, size_t max);
+
+/* Blocks that own whole cache lines, so threads do not share lines */
+extern void *mm_malloc_isolated(size_t size);
+extern void mm_free_isolated(void *ptr);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
+
+/* Same checks as mm_checkheap, but returns -1 instead of aborting when
+ * the heap is broken, and 0 when it is consistent */
+extern int mm_verify(void);
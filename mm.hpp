@@ -0,0 +1,193 @@
+/*
+ * mm.hpp - C++ interface to the allocator in mm.c
+ *
+ * mm::memory_resource is a std::pmr::memory_resource for pmr containers.
+ * mm::allocator is a std::allocator replacement for plain containers.
+ * Both serve small objects from pools (see mm_pool_create), found again
+ * on deallocation by the size that C++ passes in, and larger ones with
+ * malloc. The heap must be set up with mm_init first. Pools belong to
+ * the heap they were made in (see mm_generation): after the next mm_init
+ * or mm_open new ones are made, and objects of the old heap are gone with
+ * it, so deallocating them does nothing.
+ */
+#ifndef MM_HPP
+#define MM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+
+extern "C" {
+#include "memlib.h"
+#include "mm.h"
+}
+
+namespace mm {
+
+#ifdef DRIVER
+inline void *heap_malloc(std::size_t size) { return mm_malloc(size); }
+inline void *heap_memalign(std::size_t alignment, std::size_t size) {
+  return mm_memalign(alignment, size);
+}
+inline void heap_free(void *ptr) { mm_free(ptr); }
+#else
+inline void *heap_malloc(std::size_t size) { return malloc(size); }
+inline void *heap_memalign(std::size_t alignment, std::size_t size) {
+  return memalign(alignment, size);
+}
+inline void heap_free(void *ptr) { free(ptr); }
+#endif
+
+/* Objects up to this size come from pools, one per ALIGNMENT multiple */
+constexpr std::size_t POOL_MAX = 256;
+constexpr std::size_t POOL_CLASSES = POOL_MAX / ALIGNMENT;
+
+/*
+ * heap_allocate - allocate from malloc or memalign, throw if out of heap
+ */
+inline void *heap_allocate(std::size_t bytes, std::size_t alignment) {
+  void *p = alignment <= ALIGNMENT ? heap_malloc(bytes)
+                                   : heap_memalign(alignment, bytes);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+
+/*
+ * heap_pool - pool made on first use in the current heap
+ */
+struct heap_pool {
+  mm_pool_t *pool = nullptr;
+  unsigned long generation = 0; /* mm_generation the pool was made in */
+
+  bool current() const { return pool && generation == mm_generation(); }
+};
+
+/*
+ * pool_allocate - allocate from pool, made again in a new heap, or throw
+ */
+inline void *pool_allocate(heap_pool &hp, std::size_t size) {
+  if (!hp.current()) {
+    if (!(hp.pool = mm_pool_create(size, ALIGNMENT)))
+      throw std::bad_alloc();
+    hp.generation = mm_generation();
+  }
+  void *p = mm_pool_alloc(hp.pool);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+
+/*
+ * pool_deallocate - give object back, unless its heap is gone
+ */
+inline void pool_deallocate(heap_pool &hp, void *p) {
+  if (hp.current())
+    mm_pool_free(hp.pool, p);
+}
+
+/*
+ * memory_resource - pmr resource that owns a pool for each small size
+ *    class and releases them all when destroyed
+ */
+class memory_resource : public std::pmr::memory_resource {
+public:
+  memory_resource() = default;
+  memory_resource(const memory_resource &) = delete;
+  memory_resource &operator=(const memory_resource &) = delete;
+
+  ~memory_resource() override {
+    for (heap_pool &hp : pools)
+      if (hp.current())
+        mm_pool_destroy(hp.pool);
+  }
+
+private:
+  heap_pool pools[POOL_CLASSES] = {};
+
+  static std::size_t size_class(std::size_t bytes) {
+    return bytes == 0 ? 0 : (bytes - 1) / ALIGNMENT;
+  }
+
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+    if (bytes <= POOL_MAX && alignment <= ALIGNMENT) {
+      std::size_t i = size_class(bytes);
+      return pool_allocate(pools[i], (i + 1) * ALIGNMENT);
+    }
+    return heap_allocate(bytes, alignment);
+  }
+
+  /* Size and alignment tell which pool the object came from */
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override {
+    if (bytes <= POOL_MAX && alignment <= ALIGNMENT)
+      pool_deallocate(pools[size_class(bytes)], p);
+    else
+      heap_free(p);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+    noexcept override {
+    return this == &other;
+  }
+};
+
+/*
+ * class_pool - pool shared by all allocators with the same size class
+ */
+template <std::size_t SizeClass> heap_pool &class_pool() {
+  static heap_pool pool;
+  return pool;
+}
+
+/*
+ * allocator - std::allocator replacement. Allocations of up to SizeClass
+ *    bytes share one pool of SizeClass byte objects, so a hint equal to
+ *    the node size of a container puts all its nodes in one pool. Larger
+ *    allocations, or all of them if SizeClass is 0, use malloc.
+ */
+template <class T, std::size_t SizeClass = 0> class allocator {
+public:
+  using value_type = T;
+
+  template <class U> struct rebind { using other = allocator<U, SizeClass>; };
+
+  allocator() noexcept = default;
+  template <class U>
+  allocator(const allocator<U, SizeClass> &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    if (n > SIZE_MAX / sizeof(T))
+      throw std::bad_array_new_length();
+    std::size_t bytes = n * sizeof(T);
+    if (bytes <= SizeClass && alignof(T) <= ALIGNMENT) {
+      void *p = pool_allocate(class_pool<SizeClass>(), SizeClass);
+      return static_cast<T *>(p);
+    }
+    return static_cast<T *>(heap_allocate(bytes, alignof(T)));
+  }
+
+  void deallocate(T *p, std::size_t n) noexcept {
+    if (n * sizeof(T) <= SizeClass && alignof(T) <= ALIGNMENT)
+      pool_deallocate(class_pool<SizeClass>(), p);
+    else
+      heap_free(p);
+  }
+};
+
+template <class T, class U, std::size_t SizeClass>
+bool operator==(const allocator<T, SizeClass> &,
+                const allocator<U, SizeClass> &) noexcept {
+  return true;
+}
+
+template <class T, class U, std::size_t SizeClass>
+bool operator!=(const allocator<T, SizeClass> &,
+                const allocator<U, SizeClass> &) noexcept {
+  return false;
+}
+
+} // namespace mm
+
+#endif /* MM_HPP */
@@ -0,0 +1,221 @@
+/*
+ * persistbench.c - Time to get a filled cache back after restart: cold
+ *                  rebuild against reopening a heap kept in a file.
+ *
+ * The cache is a chained hash table whose nodes and buckets are allocated
+ * with mm_malloc and linked by heap handles. Cold rebuild makes a fresh
+ * heap and allocates and fills every node again. Warm restart builds the
+ * table once in a heap kept in a file (see mem_open), saves it with
+ * mm_checkpoint and then times mem_open and mm_open, which checks the
+ * whole heap with mm_verify before it is used. With -c the file is then
+ * damaged, and mm_open must refuse it.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+#define NBUCKETS (1 << 16)
+#define MINLEN 16   /* shortest value */
+#define MAXLEN 256  /* longest value */
+#define SAMPLE 1000 /* keys looked up after restart */
+
+typedef struct {
+  mem_handle_t next; /* next node in bucket, 0 ends the chain */
+  uint32_t key;
+  uint32_t len;
+  unsigned char data[];
+} node_t;
+
+static double now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1E-6 * tv.tv_usec;
+}
+
+/*
+ * value_len, value_byte - contents of the value stored under key
+ */
+static uint32_t value_len(uint32_t key) {
+  return MINLEN + (key * 2654435761u) % (MAXLEN - MINLEN + 1);
+}
+
+static unsigned char value_byte(uint32_t key, uint32_t i) {
+  return (key * 31 + i) & 0xff;
+}
+
+/*
+ * build - allocate the bucket array and n filled nodes in the current heap
+ */
+static mem_handle_t *build(long n) {
+  mem_handle_t *buckets = mm_malloc(NBUCKETS * sizeof(mem_handle_t));
+
+  if (buckets == NULL)
+    return NULL;
+  memset(buckets, 0, NBUCKETS * sizeof(mem_handle_t));
+
+  for (uint32_t key = 0; key < n; key++) {
+    uint32_t len = value_len(key);
+    node_t *node = mm_malloc(sizeof(node_t) + len);
+    if (node == NULL)
+      return NULL;
+    node->key = key;
+    node->len = len;
+    for (uint32_t i = 0; i < len; i++)
+      node->data[i] = value_byte(key, i);
+    node->next = buckets[key % NBUCKETS];
+    buckets[key % NBUCKETS] = mem_handle(node);
+  }
+
+  return buckets;
+}
+
+/*
+ * lookup - check that key is in the table with the right value
+ */
+static int lookup(mem_handle_t *buckets, uint32_t key) {
+  mem_handle_t h = buckets[key % NBUCKETS];
+
+  while (h) {
+    node_t *node = mem_handle_ptr(mem_heap_lo(), h);
+    if (node->key == key) {
+      if (node->len != value_len(key))
+        return 0;
+      for (uint32_t i = 0; i < node->len; i++)
+        if (node->data[i] != value_byte(key, i))
+          return 0;
+      return 1;
+    }
+    h = node->next;
+  }
+
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: persistbench [-chk] [-n <entries>] [-f <file>]\n");
+  fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-c            Check that a damaged heap is refused.\n");
+  fprintf(stderr, "\t-f <file>     Keep the heap in <file>.\n");
+  fprintf(stderr, "\t-h            Print this message.\n");
+  fprintf(stderr, "\t-k            Keep the heap file when done.\n");
+  fprintf(stderr, "\t-n <entries>  Put <entries> values in the cache.\n");
+}
+
+int main(int argc, char **argv) {
+  const char *path = "persistbench.heap";
+  long n = 200000;
+  int keep = 0;
+  int corrupt = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "cf:hkn:")) != EOF) {
+    switch (c) {
+      case 'c':
+        corrupt = 1;
+        break;
+
+      case 'f':
+        path = optarg;
+        break;
+
+      case 'k':
+        keep = 1;
+        break;
+
+      case 'n':
+        n = atol(optarg);
+        break;
+
+      case 'h':
+        usage();
+        exit(EXIT_SUCCESS);
+
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  /* Cold rebuild in a fresh heap */
+  double start = now();
+  mem_init();
+  if (mm_init() < 0 || build(n) == NULL) {
+    fprintf(stderr, "cold rebuild failed\n");
+    exit(EXIT_FAILURE);
+  }
+  double cold = now() - start;
+  mem_deinit();
+
+  /* Build once more in a heap kept in a file and checkpoint it */
+  unlink(path);
+  if (mem_open(path) != 0 || mm_init() < 0) {
+    perror("mem_open");
+    exit(EXIT_FAILURE);
+  }
+  mem_handle_t *buckets = build(n);
+  if (buckets == NULL) {
+    fprintf(stderr, "build in %s failed\n", path);
+    exit(EXIT_FAILURE);
+  }
+  mm_set_root(0, buckets);
+  start = now();
+  if (mm_checkpoint() < 0) {
+    perror("mm_checkpoint");
+    exit(EXIT_FAILURE);
+  }
+  double checkpoint = now() - start;
+  size_t heapsize = mem_heapsize();
+  mem_deinit();
+
+  /* Warm restart from the file */
+  start = now();
+  if (mem_open(path) != 1 || mm_open() < 0) {
+    fprintf(stderr, "reopening %s failed\n", path);
+    exit(EXIT_FAILURE);
+  }
+  buckets = mm_get_root(0);
+  double warm = now() - start;
+
+  for (long i = 0; i < SAMPLE && i < n; i++) {
+    if (!lookup(buckets, random() % n)) {
+      fprintf(stderr, "value missing after restart\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  mem_deinit();
+
+  /* Damage the heap as a torn write could: the block of the bucket array
+   * looks free, but is neither on the free list nor coalesced. The walk
+   * of mm_open does not see it, only the full check does. */
+  if (corrupt) {
+    if (mem_open(path) != 1) {
+      fprintf(stderr, "reopening %s failed\n", path);
+      exit(EXIT_FAILURE);
+    }
+    *((uint32_t *)mm_get_root(0) - 1) &= ~1u;
+    if (mm_open() == 0) {
+      fprintf(stderr, "mm_open took damaged heap in %s\n", path);
+      exit(EXIT_FAILURE);
+    }
+    mem_deinit();
+  }
+
+  if (!keep)
+    unlink(path);
+
+  printf("%ld entries, %zu KB heap\n", n, heapsize >> 10);
+  printf("cold rebuild:   %10.6f secs\n", cold);
+  printf("checkpoint:     %10.6f secs\n", checkpoint);
+  printf("warm restart:   %10.6f secs (%.1fx faster)\n", warm, cold / warm);
+  if (corrupt)
+    printf("damaged heap:   refused by mm_open\n");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+
+import subprocess
+import sys
+
+from grade import TIMEOUT, TRACEFILES
+
+
+def runtrace(policy, trace):
+    try:
+        mdriver = subprocess.run(
+                ["./mdriver-%s-fit" % policy, "-f", trace],
+                capture_output=True, timeout=TIMEOUT)
+    except subprocess.TimeoutExpired:
+        return None, None
+
+    if mdriver.returncode:
+        return None, None
+
+    # Same line of mdriver output as parsed by grade.py
+    stats = mdriver.stdout.decode().splitlines()[3][4:].split()
+    try:
+        util = float(stats[1][:-1])
+    except ValueError:
+        util = None
+
+    return util, float(stats[-2])
+
+
+def column(value, fmt, width):
+    return ('-' if value is None else fmt % value).rjust(width)
+
+
+if __name__ == '__main__':
+    policies = sys.argv[1:] or ['first', 'next', 'address', 'best', 'good']
+
+    print('%-26s' % 'trace' +
+          ''.join(('%s-fit' % p).center(17) for p in policies))
+    print('%-26s' % '' + ('%7s %8s ' % ('util', 'Kops')) * len(policies))
+
+    results = {p: [] for p in policies}
+
+    for trace in TRACEFILES:
+        line = '%-26s' % trace.split('/')[-1]
+        for policy in policies:
+            util, kops = runtrace(policy, trace)
+            results[policy].append((util, kops))
+            line += column(util, '%.1f%%', 7) + column(kops, '%.0f', 9) + ' '
+        print(line)
+        sys.stdout.flush()
+
+    line = '%-26s' % 'average'
+    for policy in policies:
+        utils = [u for u, _ in results[policy] if u is not None]
+        kops = [k for _, k in results[policy] if k is not None]
+        util = sum(utils) / len(utils) if utils else None
+        kops = sum(kops) / len(kops) if kops else None
+        line += column(util, '%.1f%%', 7) + column(kops, '%.0f', 9) + ' '
+    print(line)
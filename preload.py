@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+
+import argparse
+import os
+import subprocess
+import sys
+import time
+
+from bench import median
+
+LIBMM = os.path.abspath('libmm.so')
+RUNS = 5
+
+
+def runonce(command, preload):
+    """Return wall time in seconds and peak RSS in KiB of one run."""
+    env = dict(os.environ)
+    if preload:
+        env['LD_PRELOAD'] = LIBMM
+    else:
+        env.pop('LD_PRELOAD', None)
+
+    start = time.perf_counter()
+    child = subprocess.Popen(command, env=env, stdout=subprocess.DEVNULL)
+    _, status, rusage = os.wait4(child.pid, 0)
+    secs = time.perf_counter() - start
+
+    if os.waitstatus_to_exitcode(status):
+        sys.exit('%s failed%s' % (' '.join(command),
+                                  ' with libmm.so' if preload else ''))
+    return secs, rusage.ru_maxrss
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+        description='Run a command with glibc malloc and with libmm.so '
+                    'preloaded, and compare wall time and peak RSS.')
+    parser.add_argument('-n', '--runs', type=int, default=RUNS,
+                        help='runs of each (default %d)' % RUNS)
+    parser.add_argument('command', nargs=argparse.REMAINDER)
+    args = parser.parse_args()
+    if not args.command:
+        parser.error('no command given')
+    if not os.path.exists(LIBMM):
+        sys.exit('%s not found, build it with "make libmm.so"' % LIBMM)
+
+    # Interleaved, so drift of the machine hits both the same
+    results = {False: [], True: []}
+    for i in range(args.runs):
+        for preload in (False, True):
+            results[preload].append(runonce(args.command, preload))
+
+    print('%-8s %10s %10s %12s' % ('malloc', 'median s', 'best s',
+                                   'peak RSS KiB'))
+    for preload, name in ((False, 'glibc'), (True, 'libmm')):
+        secs = [s for s, _ in results[preload]]
+        rss = max(r for _, r in results[preload])
+        print('%-8s %10.3f %10.3f %12d' % (name, median(secs), min(secs),
+                                           rss))
+
+    glibc = median([s for s, _ in results[False]])
+    libmm = median([s for s, _ in results[True]])
+    print('libmm.so takes %.2fx the time of glibc' % (libmm / glibc))
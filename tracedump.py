@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+
+import struct
+import sys
+
+# Layout of mm_trace_event_t on x86-64, see mm.h
+EVENT = struct.Struct('<QQQBB6x')
+
+OPS = ['malloc', 'free', 'realloc', 'memalign']
+PATHS = ['fit', 'extend', 'merge', 'buddy', 'in-place', 'copy']
+
+
+def path_name(op, path):
+    names = [name for bit, name in enumerate(PATHS) if path & (1 << bit)]
+    return '%s %s' % (OPS[op], '+'.join(names) or '-')
+
+
+def percentile(cycles, p):
+    return cycles[min(len(cycles) - 1, len(cycles) * p // 100)]
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        print('Usage: %s <file written by mdriver -T>' % sys.argv[0])
+        sys.exit(1)
+
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+
+    paths = {}
+    for cycles, size, result, op, path in EVENT.iter_unpack(data):
+        paths.setdefault(path_name(op, path), []).append(cycles)
+
+    total = sum(sum(c) for c in paths.values()) or 1
+
+    print('%-24s %8s %7s %8s %8s %8s %8s %9s' %
+          ('path', 'calls', 'time', 'mean', 'p50', 'p99', 'max', 'cycles'))
+    for name, cycles in sorted(paths.items(), key=lambda p: -sum(p[1])):
+        cycles.sort()
+        print('%-24s %8d %6.1f%% %8.0f %8d %8d %8d %9d' %
+              (name, len(cycles), 100.0 * sum(cycles) / total,
+               sum(cycles) / len(cycles), percentile(cycles, 50),
+               percentile(cycles, 99), cycles[-1], sum(cycles)))